@@ -5,12 +5,17 @@
 #define APE_SRC_EXTENSION ".c"
 #define APE_OBJ_EXTENSION ".o"
 #define APE_BUILD_SRC_ARGS(infile, outfile) "-c", infile, "-o", outfile
+#define APE_BUILD_DEPFILE_ARGS(depfile) "-MMD", "-MF", depfile
 #define APE_LINK_ARGS(outfile) "-o", outfile
 #define APE_LINK_ARGS_ADD_LIB(lib) "-l" lib
 #define APE_LINK_ARGS_ADD_LIBDIR(dir) "-L" dir
 #define APE_LINK_ARGS_SHARED_LIB(outfile) "-shared", "-fPIC", "-o", outfile
 #define APE_LIB_PREFIX "lib"
 #define APE_LIB_SUFFIX ".so"
+#define APE_STATIC_LIB_SUFFIX ".a"
+#define APEAR "ar"
+#define APE_ARCHIVE_ARGS(outfile) "rcs", outfile
+#define APE_ARCHIVE_THIN_ARGS(outfile) "rcsT", outfile
 #include "apebuild.h"
 
 // Global configuration options
@@ -25,6 +30,46 @@ APEBUILD_MAIN(int argc, char **argv)
 		APE_INCLUDE_DIR("include/"); // Add include directory
 	});
 
+	// Benchmark of apebuild itself on generated projects
+	APE_BUILDER("apebench", {
+		APE_INPUT_DIR("bench/");
+	});
+
+	// Check of the command list API, run ./build/check_gen_commands
+	APE_BUILDER("check_gen_commands", {
+		APE_INPUT_FILE("tests/gen_commands.c");
+	});
+
+	// Check of the jobserver, run ./build/check_jobserver
+	APE_BUILDER("check_jobserver", {
+		APE_INPUT_FILE("tests/jobserver.c");
+	});
+
+	// Check of the depfile parser, run ./build/check_depfile
+	APE_BUILDER("check_depfile", {
+		APE_INPUT_FILE("tests/depfile.c");
+	});
+
+	// Check of the build log, run ./build/check_log
+	APE_BUILDER("check_log", {
+		APE_INPUT_FILE("tests/log.c");
+	});
+
+	// Check of the content hash, run ./build/check_xxh64
+	APE_BUILDER("check_xxh64", {
+		APE_INPUT_FILE("tests/xxh64.c");
+	});
+
+	// Check of the compilation cache, run ./build/check_cache
+	APE_BUILDER("check_cache", {
+		APE_INPUT_FILE("tests/cache.c");
+	});
+
+	// Worker daemon for distributed compiles, see --remote
+	APE_BUILDER("apebuild-worker", {
+		APE_INPUT_DIR("worker/");
+	});
+
 	// Run the builder
 	return ape_run(argc, argv);
 }
@@ -37,10 +37,29 @@ TODO: Documentation
  * you should just ignore the warnings
  */
 #define __STDC_WANT_LIB_EXT1__ 1
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <dirent.h>
+#include <spawn.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <time.h>
 #include <wait.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -60,6 +79,17 @@ typedef struct {
 	char **items;
 } ApeStrList;
 
+typedef struct ApeArenaChunk {
+	struct ApeArenaChunk *next;
+	size_t used;
+	size_t capacity;
+	char data[];
+} ApeArenaChunk;
+
+typedef struct {
+	ApeArenaChunk *head;
+} ApeArena;
+
 typedef struct {
 	size_t capacity;
 	size_t count;
@@ -72,20 +102,113 @@ typedef struct {
 	ApeCmd *items;
 } ApeCmdList;
 
+/* What a job does, which decides how it is shown, scheduled and depended
+ * on. Jobs made from plain commands only run */
+typedef enum {
+	APE_JOB_RUN,
+	APE_JOB_COMPILE,
+	APE_JOB_PCH,
+	APE_JOB_BATCH,
+	APE_JOB_LINK,
+	APE_JOB_ARCHIVE,
+} ApeJobKind;
+
+/* A command together with the file it produces, so that finished commands
+ * can be recorded in the build log */
+typedef struct {
+	ApeJobKind kind;
+	ApeCmd cmd;
+	char *output;
+	char *depfile;
+	char **inputs;
+	size_t inputs_count;
+	uint64_t signature;
+	uint64_t cache_key;
+	int64_t started;
+	/* How long the command took and its peak memory use in bytes, 0 if it
+	 * didn't run */
+	int64_t duration;
+	int64_t max_rss;
+	/* Indices of the jobs in the same list that have to finish first */
+	struct {
+		size_t capacity;
+		size_t count;
+		size_t *items;
+	} deps;
+	/* Only run if a dependency changed or the output is out of date */
+	int lazy;
+	int changed;
+	/* Working directory and environment of the command, if not NULL */
+	const char *cwd;
+	char **env;
+	/* The dependents of a batch compile with a batch_obj are the compiles
+	 * it stands for. If it succeeded they are marked batched and only move
+	 * batch_obj to their output, otherwise they run on their own */
+	char *batch_obj;
+	int batched;
+	/* Shown in the status line instead of the command, if not NULL */
+	const char *description;
+	/* A compile that can run on a worker, whose first remote_flags cmd
+	 * items are the compiler and the flags it needs there, and the worker
+	 * it runs on plus one */
+	size_t remote_flags;
+	int worker;
+} ApeJob;
+
+typedef struct {
+	size_t capacity;
+	size_t count;
+	ApeJob *items;
+} ApeJobList;
+
 typedef int ApeProc;
 #define APE_INVALID_PROC (-1)
 
 void ape_cmd_render(ApeCmd cmd, ApeStrBuilder *render);
+ApeProc ape_spawn(ApeCmd cmd, const char *cwd, char *const *env);
 ApeProc ape_run_cmd_async(ApeCmd cmd);
 int ape_proc_wait(int proc);
 int ape_cmd_run_sync(ApeCmd cmd);
 int ape_cmds_run(ApeCmdList cmds);
+int ape_cmds_run_parallel(ApeCmdList cmds, size_t jobs);
+int ape_job_finish(ApeJob *job);
+int ape_jobs_run_parallel(ApeJobList jobs, size_t njobs);
+int ape_jobserver_open(size_t njobs);
+void ape_jobserver_close(void);
+void ape_job_free(ApeJob job);
+int ape_trace_write(const char *path);
+
+void *ape_arena_alloc(ApeArena *arena, size_t size);
+char *ape_arena_strndup(ApeArena *arena, const char *s, size_t n);
+void ape_arena_free(ApeArena *arena);
 
 int ape_rename(const char *oldname, const char *newname);
+char *ape_intern(const char *path);
 char *ape_objfile_name(char *srcfilename);
+char *ape_depfile_name(char *srcfilename);
+const struct stat *ape_stat_cached(const char *path);
+void ape_stat_cache_invalidate(const char *path);
 int ape_needs_rebuild(const char *outfile, char **infiles, size_t len);
 int ape_needs_rebuild1(const char *outfile, const char *infile);
+int ape_parse_depfile(const char *depfile, ApeStrList *deps);
+int ape_needs_rebuild_depfile(const char *outfile, const char *srcfile,
+			      const char *depfile);
 int ape_endswith(char *s, const char *suffix);
+int ape_mkdir_p(const char *path);
+
+uint64_t ape_hash64(const void *data, size_t len, uint64_t seed);
+uint64_t ape_cmd_signature(ApeCmd cmd);
+int ape_log_open(const char *path);
+void ape_log_close(void);
+int ape_log_needs_rebuild(const char *outfile, uint64_t signature);
+int ape_log_record(const char *outfile, uint64_t signature, char **inputs,
+		   size_t len, int64_t duration, int64_t max_rss);
+int64_t ape_log_duration(const char *outfile);
+int64_t ape_log_max_rss(const char *outfile);
+uint64_t ape_log_hash(const char *outfile);
+int ape_cache_open(const char *dir);
+int ape_cache_fetch(ApeJob *job, const char *srcfile);
+int ape_cache_store(ApeJob *job, char **deps, size_t len);
 
 typedef struct {
 	struct {
@@ -97,27 +220,67 @@ typedef struct {
 	uint16_t flags;
 	ApeStrList extra_build_args;
 	ApeStrList extra_link_args;
+	ApeStrList depends;
+	/* With APE_FLAG_UNITY: number of unity sources to aim for (0 to go by
+	 * APE_UNITY_BATCH_SIZE) and sources that must be compiled alone */
+	size_t unity_batches;
+	ApeStrList unity_exclude;
+	/* Header to precompile and include in every source, or NULL */
+	char *pch;
+	/* Directories the sources were scanned from, as prefixes ending in
+	 * '/', for watch mode */
+	ApeStrList source_dirs;
+	ApeStrList source_dirs_rec;
+	/* Arguments of the training runs of the instrumented binary, with
+	 * the binary itself left NULL. PGO is off if empty */
+	ApeCmdList pgo_train;
 } ApeBuilder;
 
+/* A named configuration every target can be built in, with its own flags and
+ * its own tree of outputs in APE_OUTPUT_DIR/<name>/ */
+typedef struct {
+	const char *name;
+	ApeStrList build_args;
+	ApeStrList link_args;
+} ApeVariant;
+
+ApeJob ape_gen_build_job(char *srcfilename, uint16_t flags, ApeStrList args);
+ApeJob ape_gen_link_job(char *outfilename, char **srcfilenames, size_t len,
+			uint16_t flags, ApeStrList args);
 ApeCmd ape_gen_build_command(char *srcfilename, uint16_t flags,
 			     ApeStrList args);
 ApeCmd ape_gen_link_command(char *outfilename, char **srcfilenames, size_t len,
 			    uint16_t flags, ApeStrList args);
+size_t ape_builder_add_jobs(ApeBuilder *builder, ApeJobList *graph);
+ApeJobList ape_builder_gen_jobs(ApeBuilder *builder);
 ApeCmdList ape_builder_gen_commands(ApeBuilder *builder);
+int ape_gen_graph(ApeJobList *graph);
 void ape_builder_append_file(ApeBuilder *builder, char *path);
 int ape_builder_append_dir(ApeBuilder *builder, char *path);
 int ape_builder_append_dir_recursive(ApeBuilder *builder, char *path);
 int ape_run_builder(ApeBuilder *builder);
 
 int ape_run(int argc, char **argv);
+int ape_worker_run(int argc, char **argv);
 
 #ifndef APE_OUTPUT_DIR
 #define APE_OUTPUT_DIR "build/"
 #endif
 #define APE__OUTPUT_DIR(file) APE_OUTPUT_DIR file
 
+#ifndef APE_LOG_FILE
+#define APE_LOG_FILE APE__OUTPUT_DIR(".ape_log")
+#endif
+
+#ifndef APE_CACHE_MAX_SIZE
+#define APE_CACHE_MAX_SIZE (5ULL << 30)
+#endif
+
 #ifndef APE_REBUILD_COMMAND
 #define APE_REBUILD_COMMAND(out, in) "gcc", "-o", out, in
+#ifndef APE_REBUILD_DEPFILE_ARGS
+#define APE_REBUILD_DEPFILE_ARGS(depfile) "-MMD", "-MF", depfile
+#endif
 #endif
 
 #ifdef APE_PRESET_LINUX_GCC_C
@@ -126,12 +289,34 @@ int ape_run(int argc, char **argv);
 #define APE_OBJ_EXTENSION ".o"
 #define APE_SRC_EXTENSION ".c"
 #define APE_BUILD_SRC_ARGS(infile, outfile) "-c", infile, "-o", outfile
+#define APE_BUILD_DEPFILE_ARGS(depfile) "-MMD", "-MF", depfile
 #define APE_LINK_ARGS(outfile) "-o", outfile
 #define APE_LINK_ARGS_ADD_LIB(lib) "-l" lib
 #define APE_LINK_ARGS_ADD_LIBDIR(dir) "-L" dir
 #define APE_LINK_ARGS_SHARED_LIB(outfile) "-shared", "-fPIC", "-o", outfile
 #define APE_LIB_PREFIX "lib"
 #define APE_LIB_SUFFIX ".so"
+#define APE_STATIC_LIB_SUFFIX ".a"
+#define APEAR "gcc-ar"
+#define APE_ARCHIVE_ARGS(outfile) "rcs", outfile
+#define APE_ARCHIVE_THIN_ARGS(outfile) "rcsT", outfile
+#define APE_LINK_ARGS_USE_LD(ld) "-fuse-ld=" ld
+#define APE_BUILD_ARGS_LTO "-flto"
+#define APE_LINK_ARGS_LTO "-flto=auto"
+#define APE_BUILD_SEED_ARG "-frandom-seed="
+#define APE_PCH_EXTENSION ".gch"
+#define APE_BUILD_PCH_ARGS(infile, outfile) \
+	"-x", "c-header", "-c", infile, "-o", outfile
+#define APE_BUILD_USE_PCH_ARGS(header) "-include", header
+#define APE_BUILD_PREPROCESS_ARGS(infile, outfile) "-E", infile, "-o", outfile
+#define APE_PREPROCESSED_EXTENSION ".i"
+#define APE_BUILD_BATCH_ARGS "-MMD", "-c"
+#define APE_BUILD_PREFIX_MAP_ARG "-ffile-prefix-map="
+#define APE_PGO_GENERATE_ARG "-fprofile-generate="
+#define APE_PGO_USE_ARG "-fprofile-use="
+#define APE_PGO_PREFIX_ARG "-fprofile-prefix-path="
+#define APE_PGO_USE_ARGS "-fprofile-partial-training"
+#define APE_PGO_PROFILE_EXTENSION ".gcda"
 #endif
 
 #ifdef APE_PRESET_LINUX_GCC_CXX
@@ -140,18 +325,46 @@ int ape_run(int argc, char **argv);
 #define APE_OBJ_EXTENSION ".o"
 #define APE_SRC_EXTENSION ".cpp"
 #define APE_BUILD_SRC_ARGS(infile, outfile) "-c", infile, "-o", outfile
+#define APE_BUILD_DEPFILE_ARGS(depfile) "-MMD", "-MF", depfile
 #define APE_LINK_ARGS(outfile) "-o", outfile
 #define APE_LINK_ARGS_ADD_LIB(lib) "-l" lib
 #define APE_LINK_ARGS_ADD_LIBDIR(dir) "-L" dir
 #define APE_LINK_ARGS_SHARED_LIB(outfile) "-shared", "-fPIC", "-o", outfile
 #define APE_LIB_PREFIX "lib"
 #define APE_LIB_SUFFIX ".so"
+#define APE_STATIC_LIB_SUFFIX ".a"
+#define APEAR "gcc-ar"
+#define APE_ARCHIVE_ARGS(outfile) "rcs", outfile
+#define APE_ARCHIVE_THIN_ARGS(outfile) "rcsT", outfile
+#define APE_LINK_ARGS_USE_LD(ld) "-fuse-ld=" ld
+#define APE_BUILD_ARGS_LTO "-flto"
+#define APE_LINK_ARGS_LTO "-flto=auto"
+#define APE_BUILD_SEED_ARG "-frandom-seed="
+#define APE_PCH_EXTENSION ".gch"
+#define APE_BUILD_PCH_ARGS(infile, outfile) \
+	"-x", "c++-header", "-c", infile, "-o", outfile
+#define APE_BUILD_USE_PCH_ARGS(header) "-include", header
+#define APE_BUILD_PREPROCESS_ARGS(infile, outfile) "-E", infile, "-o", outfile
+#define APE_PREPROCESSED_EXTENSION ".ii"
+#define APE_BUILD_BATCH_ARGS "-MMD", "-c"
+#define APE_BUILD_PREFIX_MAP_ARG "-ffile-prefix-map="
+#define APE_PGO_GENERATE_ARG "-fprofile-generate="
+#define APE_PGO_USE_ARG "-fprofile-use="
+#define APE_PGO_PREFIX_ARG "-fprofile-prefix-path="
+#define APE_PGO_USE_ARGS "-fprofile-partial-training"
+#define APE_PGO_PROFILE_EXTENSION ".gcda"
 #endif
 
 #define APE_SET_FLAG(flag) (ape__builder.flags |= (1 << flag))
 enum ApeFlag {
 	APE_FLAG_REBUILD,
 	APE_FLAG_SHARED_LIB,
+	APE_FLAG_UNITY,
+	APE_FLAG_BATCH,
+	APE_FLAG_STATIC_LIB,
+	/* A static library that only refers to its objects */
+	APE_FLAG_THIN_ARCHIVE,
+	APE_FLAG_LTO,
 };
 
 #define APE_BUILDER(name, input)                                           \
@@ -160,6 +373,14 @@ enum ApeFlag {
 		{ input } ape_da_append(&ape__builder_list, ape__builder); \
 	} while (0);
 
+#define APE_VARIANT(vname, input)                                          \
+	do {                                                               \
+		ApeVariant ape__variant = (ApeVariant){ .name = vname };   \
+		{ input } ape_da_append(&ape__variant_list, ape__variant); \
+	} while (0);
+#define APE_VARIANT_BUILD_ARG(arg) ape_da_append(&ape__variant.build_args, arg)
+#define APE_VARIANT_LINK_ARG(arg) ape_da_append(&ape__variant.link_args, arg)
+
 #define APE_INPUT_DIR(path) ape_builder_append_dir(&ape__builder, path)
 #define APE_INPUT_DIR_REC(path) \
 	ape_builder_append_dir_recursive(&ape__builder, path)
@@ -172,37 +393,28 @@ enum ApeFlag {
 #define APE_ADD_LIBDIR(path)                         \
 	ape_da_append(&ape__builder.extra_link_args, \
 		      APE_LINK_ARGS_ADD_LIBDIR(path))
+#define APE_LINKER(name)                             \
+	ape_da_append(&ape__builder.extra_link_args, \
+		      APE_LINK_ARGS_USE_LD(name))
+#define APE_DEPENDS(name)                                   \
+	do {                                                \
+		ape_da_append(&ape__builder.depends, name); \
+		ape_da_append(&ape__builder.extra_link_args,\
+			      APE_LINK_ARGS_ADD_LIB(name)); \
+	} while (0)
 
-#define APE_REBUILD(argc, argv)                                                \
-	do {                                                                   \
-		const char *srcpath = __FILE__;                                \
-		assert(argc >= 1);                                             \
-		const char *binpath = argv[0];                                 \
-		int rebuild_needed = ape_needs_rebuild1(binpath, srcpath);     \
-		if (rebuild_needed < 0)                                        \
-			exit(1);                                               \
-		if (rebuild_needed) {                                          \
-			ApeStrBuilder sb = { 0 };                              \
-			ape_sb_append_str(&sb, binpath);                       \
-			ape_sb_append_str(&sb, ".old");                        \
-			ape_da_append(&sb, '\0');                              \
-			if (!ape_rename(binpath, sb.items))                    \
-				exit(1);                                       \
-			ApeCmd rebuild = { 0 };                                \
-			ape_cmd_append(&rebuild,                               \
-				       APE_REBUILD_COMMAND(binpath, srcpath)); \
-			int rebuilt = ape_cmd_run_sync(rebuild);               \
-			if (!rebuilt) {                                        \
-				ape_rename(sb.items, binpath);                 \
-				exit(1);                                       \
-			}                                                      \
-			ApeCmd cmd = { 0 };                                    \
-			ape_da_append_many(&cmd, argv, argc);                  \
-			if (!ape_cmd_run_sync(cmd))                            \
-				exit(1);                                       \
-			exit(0);                                               \
-		}                                                              \
+#define APE_PCH(path) (ape__builder.pch = path)
+#define APE_PGO_TRAIN(...)                                         \
+	do {                                                       \
+		ApeCmd ape__train = { 0 };                         \
+		ape_cmd_append(&ape__train, NULL, ##__VA_ARGS__);  \
+		ape_da_append(&ape__builder.pgo_train, ape__train); \
 	} while (0)
+#define APE_UNITY_BATCHES(n) (ape__builder.unity_batches = (n))
+#define APE_UNITY_EXCLUDE(path) \
+	ape_da_append(&ape__builder.unity_exclude, path)
+
+#define APE_REBUILD(argc, argv) ape__rebuild(argc, argv, __FILE__)
 
 #define APEBUILD_MAIN(...)                        \
 	int apebuild_main(int argc, char **argv); \
@@ -237,6 +449,15 @@ enum ApeFlag {
 #pragma GCC error("Define APE_LINK_ARGS(outfile)")
 #endif
 
+#ifndef APE_BUILD_DEPFILE_ARGS
+#pragma GCC warning \
+	"If you want header changes to trigger rebuilds, you should define APE_BUILD_DEPFILE_ARGS(depfile)"
+#endif
+
+#ifndef APE_DEP_EXTENSION
+#define APE_DEP_EXTENSION ".d"
+#endif
+
 #ifndef APE_LINK_ARGS_ADD_LIB
 #pragma GCC warning \
 	"If you have library dependencies, you should define APE_LINK_ARGS_ADD_LIB(lib)"
@@ -252,11 +473,13 @@ enum ApeFlag {
 	"If you are building libraries, you should define APE_LINK_ARGS_SHARED_LIB"
 #endif
 
-#define APE_DA_INIT_CAP 256
+#ifndef APE_DA_INIT_CAP
+#define APE_DA_INIT_CAP 16
+#endif
 
 #define ape_da_append(da, x)                                              \
 	do {                                                              \
-		if ((da)->count + 1 >= (da)->capacity) {                  \
+		if ((da)->count >= (da)->capacity) {                      \
 			(da)->capacity = (da)->capacity == 0 ?            \
 						 APE_DA_INIT_CAP :        \
 						 (da)->capacity * 2;      \
@@ -280,11 +503,22 @@ enum ApeFlag {
 					      (da)->capacity *               \
 						      sizeof(*(da)->items)); \
 		}                                                            \
-		memcpy((da)->items + (da)->count, (xs),                      \
-		       (n) * sizeof(*(da)->items));                          \
+		if ((n) > 0)                                                 \
+			memcpy((da)->items + (da)->count, (xs),              \
+			       (n) * sizeof(*(da)->items));                  \
 		(da)->count += (n);                                          \
 	} while (0)
 
+#define ape_da_reserve(da, n)                                              \
+	do {                                                               \
+		if ((da)->capacity < (n)) {                                \
+			(da)->capacity = (n);                              \
+			(da)->items = realloc((da)->items,                 \
+					      (da)->capacity *             \
+						      sizeof(*(da)->items)); \
+		}                                                          \
+	} while (0)
+
 #define ape_da_free(da) free(da.items)
 
 #define ape_sb_append_str(sb, str)            \
@@ -301,6 +535,52 @@ enum ApeFlag {
 
 #define ape_cmd_free(cmd) free(cmd.items)
 
+#define APE_ARENA_CHUNK_SIZE (64 * 1024)
+
+void *ape_arena_alloc(ApeArena *arena, size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+	ApeArenaChunk *chunk = arena->head;
+	if (!chunk || chunk->used + size > chunk->capacity) {
+		size_t capacity = size > APE_ARENA_CHUNK_SIZE ?
+					  size :
+					  APE_ARENA_CHUNK_SIZE;
+		chunk = malloc(sizeof(ApeArenaChunk) + capacity);
+		if (!chunk) {
+			fprintf(stderr, "ERROR: Out of memory\n");
+			abort();
+		}
+		chunk->used = 0;
+		chunk->capacity = capacity;
+		chunk->next = arena->head;
+		arena->head = chunk;
+	}
+	void *p = chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+char *ape_arena_strndup(ApeArena *arena, const char *s, size_t n)
+{
+	char *p = ape_arena_alloc(arena, n + 1);
+	memcpy(p, s, n);
+	p[n] = 0;
+	return p;
+}
+
+void ape_arena_free(ApeArena *arena)
+{
+	while (arena->head) {
+		ApeArenaChunk *next = arena->head->next;
+		free(arena->head);
+		arena->head = next;
+	}
+}
+
+/* Everything that lives for the whole build session: interned paths, object
+ * and depfile names and the input lists of jobs */
+ApeArena ape__arena = { 0 };
+
 void ape_cmd_render(ApeCmd cmd, ApeStrBuilder *render)
 {
 	for (size_t i = 0; i < cmd.count; i++) {
@@ -319,79 +599,396 @@ void ape_cmd_render(ApeCmd cmd, ApeStrBuilder *render)
 	}
 }
 
-ApeProc ape_run_cmd_async(ApeCmd cmd)
+extern char **environ;
+
+/* Signal that interrupted ape_jobs_run_parallel, 0 if there was none */
+volatile sig_atomic_t ape__interrupted;
+/* Pids of the running commands, which signals to the build are forwarded to */
+pid_t *ape__children;
+volatile sig_atomic_t ape__nchildren;
+
+ApeProc ape__spawn(ApeCmd cmd, const char *cwd, char *const *env, int outfd,
+		   int echo);
+
+/* Starts cmd with posix_spawnp, so the child neither copies the page tables
+ * of the build nor allocates before exec. cwd and env replace the working
+ * directory and environment of the child if they are not NULL */
+ApeProc ape_spawn(ApeCmd cmd, const char *cwd, char *const *env)
+{
+	return ape__spawn(cmd, cwd, env, -1, 1);
+}
+
+/* Like ape_spawn, but sends the stdout and stderr of the child to outfd if
+ * it isn't -1, and only prints the command if echo is set */
+ApeProc ape__spawn(ApeCmd cmd, const char *cwd, char *const *env, int outfd,
+		   int echo)
 {
 	if (cmd.count < 1) {
 		fprintf(stderr, "ERROR: Can't execute empty command\n");
 		return APE_INVALID_PROC;
 	}
-	ApeStrBuilder sb = { 0 };
-	ape_cmd_render(cmd, &sb);
-	ape_da_append(&sb, '\0');
-	fprintf(stderr, "CMD: %s\n", sb.items);
-	ape_da_free(sb);
-	memset(&sb, 0, sizeof(sb));
+	if (echo) {
+		ApeStrBuilder sb = { 0 };
+		ape_cmd_render(cmd, &sb);
+		ape_da_append(&sb, '\0');
+		if (cwd)
+			fprintf(stderr, "CMD: cd %s && %s\n", cwd, sb.items);
+		else
+			fprintf(stderr, "CMD: %s\n", sb.items);
+		ape_da_free(sb);
+	}
 
-	pid_t cpid = fork();
-	if (cpid < 0) {
-		fprintf(stderr, "ERROR: Could not fork child process: %s\n",
-			strerror(errno));
+	const char *argv_buf[64];
+	const char **argv = argv_buf;
+	if (cmd.count >= 64)
+		argv = malloc((cmd.count + 1) * sizeof(char *));
+	memcpy(argv, cmd.items, cmd.count * sizeof(char *));
+	argv[cmd.count] = NULL;
+
+	/* The build may be catching signals, the child must not inherit that.
+	 * While signals are forwarded, each command gets its own process group
+	 * so that they also reach the processes it starts itself */
+	int own_group = ape__children != NULL;
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setpgroup(&attr, 0);
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	posix_spawnattr_setsigmask(&attr, &sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	posix_spawnattr_setsigdefault(&attr, &sigs);
+	posix_spawnattr_setflags(&attr,
+				 POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF |
+					 (own_group ? POSIX_SPAWN_SETPGROUP : 0));
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (outfd >= 0) {
+		posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, outfd, STDERR_FILENO);
+	}
+	pid_t pid;
+	int err;
+#ifdef __USE_GNU
+	if (cwd)
+		posix_spawn_file_actions_addchdir_np(&actions, cwd);
+#else
+	/* Without addchdir_np the child has to chdir itself, everything it
+	 * needs is still prepared here */
+	if (cwd) {
+		pid = fork();
+		err = pid < 0 ? errno : 0;
+		if (pid == 0) {
+			/* What the spawn attributes do on the other path */
+			sigset_t none;
+			sigemptyset(&none);
+			sigprocmask(SIG_SETMASK, &none, NULL);
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			if (own_group)
+				setpgid(0, 0);
+			if (outfd >= 0) {
+				dup2(outfd, STDOUT_FILENO);
+				dup2(outfd, STDERR_FILENO);
+			}
+			if (chdir(cwd) == 0) {
+				if (env)
+					environ = (char **)env;
+				execvp(argv[0], (char *const *)argv);
+			}
+			_exit(127);
+		}
+	} else
+#endif
+		err = posix_spawnp(&pid, argv[0], &actions, &attr,
+				   (char *const *)argv, env ? env : environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	if (argv != argv_buf)
+		free(argv);
+	if (err != 0) {
+		fprintf(stderr, "ERROR: Could not exec child process %s: %s\n",
+			cmd.items[0], strerror(err));
 		return APE_INVALID_PROC;
 	}
-	if (cpid == 0) {
-		ApeCmd cmd_null = { 0 };
-		ape_da_append_many(&cmd_null, cmd.items, cmd.count);
-		ape_cmd_append(&cmd_null, NULL);
-		if (execvp(cmd.items[0], (char *const *)cmd_null.items) < 0) {
+	return pid;
+}
+
+ApeProc ape_run_cmd_async(ApeCmd cmd)
+{
+	return ape_spawn(cmd, NULL, NULL);
+}
+
+/* Returns 1 if the child exited successfully, 0 if it failed and -1 if
+ * it has not terminated yet */
+int ape__proc_status(int wstatus)
+{
+	if (WIFEXITED(wstatus)) {
+		int exit_status = WEXITSTATUS(wstatus);
+		if (exit_status != 0) {
 			fprintf(stderr,
-				"ERROR: Could not exec child process: %s\n",
-				strerror(errno));
-			exit(1);
+				"ERROR: Command exited with "
+				"error code: %d\n",
+				exit_status);
+			return 0;
 		}
-		assert(0 && "Ureachable");
+		return 1;
 	}
-	return cpid;
+	if (WIFSIGNALED(wstatus)) {
+		fprintf(stderr, "Command was terminated by %s\n",
+			strsignal(WTERMSIG(wstatus)));
+		return 0;
+	}
+	return -1;
 }
 
-int ape_proc_wait(int proc)
+int64_t ape__mtime_ns(const struct stat *st)
+{
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+int64_t ape__now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* A span of the build profile. tid 0 is apebuild itself, the commands run
+ * by the scheduler are put on the job slot they ran in, starting at 1 */
+typedef struct {
+	const char *cat;
+	const char *name;
+	const char *output;
+	int64_t start;
+	int64_t end;
+	size_t tid;
+	int has_rusage;
+	struct rusage ru;
+} ApeTraceEvent;
+
+/* Spans are only collected with --trace, which APE_REBUILD already looks for
+ * since directories are scanned before the arguments are parsed */
+struct {
+	size_t capacity;
+	size_t count;
+	ApeTraceEvent *items;
+} ape__trace;
+
+const char *ape__trace_path = NULL;
+
+#ifndef APE_TRACE_TOP
+#define APE_TRACE_TOP 10
+#endif
+
+/* Sets the trace path if arg is --trace[=FILE], returns whether it is */
+int ape__trace_arg(const char *arg)
+{
+	if (strcmp(arg, "--trace") != 0 && strncmp(arg, "--trace=", 8) != 0)
+		return 0;
+	ape__trace_path = arg[7] == '=' ? arg + 8 : "build.json";
+	return 1;
+}
+
+void ape__trace_span(const char *cat, const char *name, int64_t start,
+		     size_t tid, const char *output, const struct rusage *ru)
+{
+	if (!ape__trace_path)
+		return;
+	ApeTraceEvent e = {
+		.cat = cat,
+		.name = ape_arena_strndup(&ape__arena, name, strlen(name)),
+		.output = output,
+		.start = start,
+		.end = ape__now_ns(),
+		.tid = tid,
+		.has_rusage = ru != NULL,
+	};
+	if (ru)
+		e.ru = *ru;
+	ape_da_append(&ape__trace, e);
+}
+
+/* Called by APE_REBUILD. A rebuilt binary can't record into the trace of the
+ * one that built it, so the span is handed over through the environment */
+void ape__trace_rebuild(int64_t start, int rebuilt)
+{
+	if (!ape__trace_path)
+		return;
+	if (!rebuilt) {
+		ape__trace_span("rebuild", "self-rebuild check", start, 0, NULL,
+				NULL);
+		return;
+	}
+	char span[64];
+	snprintf(span, sizeof(span), "%lld,%lld", (long long)start,
+		 (long long)ape__now_ns());
+	setenv("APE_TRACE_REBUILD", span, 1);
+}
+
+void ape__trace_import_rebuild(void)
+{
+	const char *span = getenv("APE_TRACE_REBUILD");
+	long long start, end;
+	if (ape__trace_path && span &&
+	    sscanf(span, "%lld,%lld", &start, &end) == 2) {
+		ape__trace_span("rebuild", "self-rebuild", start, 0, NULL,
+				NULL);
+		ape__trace.items[ape__trace.count - 1].end = end;
+	}
+	/* Nested builds have their own */
+	unsetenv("APE_TRACE_REBUILD");
+}
+
+void ape__json_str(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+double ape__tv_ms(struct timeval tv)
+{
+	return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+/* Writes the spans as Chrome trace event JSON, which chrome://tracing and
+ * Perfetto can open */
+int ape_trace_write(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "ERROR: Could not write trace %s: %s\n", path,
+			strerror(errno));
+		return 0;
+	}
+	int64_t origin = INT64_MAX;
+	size_t slots = 0;
+	for (size_t i = 0; i < ape__trace.count; i++) {
+		if (ape__trace.items[i].start < origin)
+			origin = ape__trace.items[i].start;
+		if (ape__trace.items[i].tid > slots)
+			slots = ape__trace.items[i].tid;
+	}
+	fprintf(f, "{\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		   "\"tid\":0,\"args\":{\"name\":\"apebuild\"}}");
+	for (size_t i = 1; i <= slots; i++)
+		fprintf(f,
+			",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"tid\":%zu,\"args\":{\"name\":\"job slot %zu\"}}",
+			i, i);
+	for (size_t i = 0; i < ape__trace.count; i++) {
+		const ApeTraceEvent *e = &ape__trace.items[i];
+		fprintf(f, ",\n{\"name\":");
+		ape__json_str(f, e->name);
+		fprintf(f,
+			",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+			"\"dur\":%.3f,\"pid\":1,\"tid\":%zu,\"args\":{",
+			e->cat, (e->start - origin) / 1e3,
+			(e->end - e->start) / 1e3, e->tid);
+		fprintf(f, "\"wall_ms\":%.3f", (e->end - e->start) / 1e6);
+		if (e->output) {
+			fprintf(f, ",\"output\":");
+			ape__json_str(f, e->output);
+		}
+		if (e->has_rusage)
+			fprintf(f,
+				",\"user_ms\":%.3f,\"sys_ms\":%.3f,"
+				"\"max_rss_kb\":%ld",
+				ape__tv_ms(e->ru.ru_utime),
+				ape__tv_ms(e->ru.ru_stime), e->ru.ru_maxrss);
+		fprintf(f, "}}");
+	}
+	fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	int ok = !ferror(f);
+	if (fclose(f) != 0 || !ok) {
+		fprintf(stderr, "ERROR: Could not write trace %s\n", path);
+		return 0;
+	}
+	fprintf(stderr, "INFO: Wrote build trace to %s\n", path);
+	return 1;
+}
+
+int ape__trace_cmp_duration(const void *a, const void *b)
+{
+	const ApeTraceEvent *x = *(ApeTraceEvent *const *)a;
+	const ApeTraceEvent *y = *(ApeTraceEvent *const *)b;
+	int64_t dx = x->end - x->start, dy = y->end - y->start;
+	return dx < dy ? 1 : dx > dy ? -1 : 0;
+}
+
+/* Prints the n compiles that took longest */
+void ape__trace_summary(size_t n)
+{
+	ApeTraceEvent **compiles =
+		malloc((ape__trace.count + 1) * sizeof(ApeTraceEvent *));
+	size_t count = 0;
+	for (size_t i = 0; i < ape__trace.count; i++)
+		if (strcmp(ape__trace.items[i].cat, "compile") == 0)
+			compiles[count++] = &ape__trace.items[i];
+	qsort(compiles, count, sizeof(ApeTraceEvent *),
+	      ape__trace_cmp_duration);
+	if (count > 0)
+		fprintf(stderr, "INFO: Slowest compiles:\n");
+	for (size_t i = 0; i < count && i < n; i++) {
+		const ApeTraceEvent *e = compiles[i];
+		fprintf(stderr, "INFO: %8.2fs  %6ld MiB  %s\n",
+			(e->end - e->start) / 1e9, e->ru.ru_maxrss / 1024,
+			e->name);
+	}
+	free(compiles);
+}
+
+/* Waits for proc, filling ru with its resource usage if it is not NULL */
+int ape__proc_wait(int proc, struct rusage *ru)
 {
 	if (proc == -1)
 		return 0;
 	for (;;) {
 		int wstatus = 0;
-		if (waitpid(proc, &wstatus, 0) < 0) {
+		if (wait4(proc, &wstatus, 0, ru) < 0) {
 			fprintf(stderr,
 				"ERROR: Could not wait on command (pid "
 				"%d): %s\n",
 				proc, strerror(errno));
 			return 0;
 		}
-		if (WIFEXITED(wstatus)) {
-			int exit_status = WEXITSTATUS(wstatus);
-			if (exit_status != 0) {
-				fprintf(stderr,
-					"ERROR: Command exited with "
-					"error code: %d\n",
-					exit_status);
-				return 0;
-			}
-			break;
-		}
-		if (WIFSIGNALED(wstatus)) {
-			fprintf(stderr, "Command was terminated by %s\n",
-				strsignal(WTERMSIG(wstatus)));
-			return 0;
-		}
+		int status = ape__proc_status(wstatus);
+		if (status >= 0)
+			return status;
 	}
-	return 1;
+}
+
+int ape_proc_wait(int proc)
+{
+	return ape__proc_wait(proc, NULL);
 }
 
 int ape_cmd_run_sync(ApeCmd cmd)
 {
+	int64_t start = ape__now_ns();
 	int p = ape_run_cmd_async(cmd);
 	if (p == -1)
 		return 0;
-	return ape_proc_wait(p);
+	struct rusage ru;
+	int r = ape__proc_wait(p, &ru);
+	if (ape__trace_path) {
+		ApeStrBuilder name = { 0 };
+		ape_cmd_render(cmd, &name);
+		ape_da_append(&name, 0);
+		ape__trace_span("command", name.items, start, 0, NULL, &ru);
+		ape_da_free(name);
+	}
+	return r;
 }
 
 int ape_cmds_run(ApeCmdList cmds)
@@ -404,241 +1001,5483 @@ int ape_cmds_run(ApeCmdList cmds)
 	return 1;
 }
 
-int ape_rename(const char *oldname, const char *newname)
-{
-	if (rename(oldname, newname) == 0) {
-		fprintf(stderr, "INFO: %s > %s\n", oldname, newname);
-		return 1;
-	}
-	fprintf(stderr, "ERROR: Couldn't rename file %s: %s\n", oldname,
-		strerror(errno));
-	return 0;
-}
-
-char *ape_objfile_name(char *srcfilename)
+/* The paths of a job are interned in the session arena and stay valid */
+void ape_job_free(ApeJob job)
 {
-	ApeStrBuilder sb = { 0 };
-	ape_sb_append_str(&sb, strdup(srcfilename));
-	ape_sb_append_str(&sb, APE_OBJ_EXTENSION);
-	ape_da_append(&sb, 0);
-	return sb.items;
+	ape_cmd_free(job.cmd);
+	ape_da_free(job.deps);
 }
 
-int ape_needs_rebuild(const char *outfile, char **infiles, size_t len)
+/* Whether a job compiles sources, on their own or in a batch */
+int ape__job_compiles(const ApeJob *job)
 {
-	struct stat outs;
-	if (stat(outfile, &outs) != 0) {
-		return 1;
-	}
-	struct stat ins;
-	for (size_t i = 0; i < len; i++) {
-		if (stat(infiles[i], &ins) != 0) {
-			fprintf(stderr,
-				"ERROR: Failed to get stat (of file %s): %s\n",
-				infiles[i], strerror(errno));
-			return 1;
-		}
-		if (ins.st_mtime > outs.st_mtime) {
-			return 1;
-		}
-	}
-	return 0;
+	return job->kind == APE_JOB_COMPILE || job->kind == APE_JOB_PCH ||
+	       job->kind == APE_JOB_BATCH;
 }
 
-int ape_needs_rebuild1(const char *outfile, const char *infile)
+/* Whether the output of a job is out of date with respect to its inputs */
+int ape__job_needs_run(ApeJob *job)
 {
-	return ape_needs_rebuild(outfile, (char **)&infile, 1);
+	/* Without an output it only runs when a dependency changed */
+	if (!job->output)
+		return 0;
+	int r = ape_log_needs_rebuild(job->output, job->signature);
+	if (r < 0)
+		r = ape_needs_rebuild(job->output, job->inputs,
+				      job->inputs_count);
+	return r;
 }
 
-int ape_endswith(char *s, const char *suffix)
+/* Records a successfully finished job in the build log, together with the
+ * dependencies the compiler reported for it, and sets whether its output
+ * changed */
+int ape_job_finish(ApeJob *job)
 {
-	if (!s || !suffix)
-		return 0;
-	size_t lens = strlen(s);
-	size_t lensuf = strlen(suffix);
-	if (lensuf > lens)
-		return 0;
-	return strncmp(s + lens - lensuf, suffix, lensuf) == 0;
+	job->changed = 1;
+	if (!job->output)
+		return 1;
+	uint64_t previous = ape_log_hash(job->output);
+	ApeStrList deps = { 0 };
+	int r;
+	if (job->depfile && ape_parse_depfile(job->depfile, &deps) &&
+	    deps.count > 0) {
+		/* Inputs after the source that the depfile doesn't know about,
+		 * like a precompiled header */
+		for (size_t i = 1; i < job->inputs_count; i++)
+			ape_da_append(&deps, job->inputs[i]);
+		r = ape_log_record(job->output, job->signature, deps.items,
+				   deps.count, job->duration, job->max_rss);
+		if (r && job->cache_key)
+			ape_cache_store(job, deps.items, deps.count);
+	} else {
+		r = ape_log_record(job->output, job->signature, job->inputs,
+				   job->inputs_count, job->duration,
+				   job->max_rss);
+	}
+	ape_da_free(deps);
+	/* Like ninja's restat, an output that came out the same as last time
+	 * doesn't count as changed for the lazy jobs waiting on it */
+	if (r && previous && ape_log_hash(job->output) == previous)
+		job->changed = 0;
+	return r;
 }
 
-ApeCmd ape_gen_build_command(char *srcfilename, uint16_t flags, ApeStrList args)
+/* Appends dir/path with its "." and ".." components resolved, or path alone
+ * if it is absolute */
+void ape__path_resolve(ApeStrBuilder *sb, const char *dir, const char *path)
 {
-	ApeCmd cmd = { 0 };
-	if (!(ape_needs_rebuild1(ape_objfile_name(srcfilename), srcfilename) ||
-	      ((flags >> APE_FLAG_REBUILD) && 1)))
-		return cmd;
-	ape_cmd_append(&cmd, APECC);
-	for (size_t i = 0; i < args.count; i++) {
-		ape_cmd_append(&cmd, args.items[i]);
+	ApeStrBuilder joined = { 0 };
+	if (path[0] != '/')
+		ape_sb_append_str(&joined, dir);
+	ape_sb_append_str(&joined, path);
+	ape_da_append(&joined, 0);
+	size_t root = sb->count;
+	const char *p = joined.items;
+	if (*p == '/') {
+		ape_da_append(sb, '/');
+		root++;
 	}
-	ape_cmd_append(&cmd, APE_BUILD_SRC_ARGS(srcfilename,
-						ape_objfile_name(srcfilename)));
-	return cmd;
+	for (;;) {
+		while (*p == '/')
+			p++;
+		size_t len = strcspn(p, "/");
+		if (len == 0)
+			break;
+		size_t last = sb->count;
+		while (last > root && sb->items[last - 1] != '/')
+			last--;
+		int up = len == 2 && p[0] == '.' && p[1] == '.';
+		int last_up = sb->count - last == 2 && sb->items[last] == '.' &&
+			      sb->items[last + 1] == '.';
+		if (len == 1 && p[0] == '.') {
+			/* Nothing to add */
+		} else if (up && sb->count > root && !last_up) {
+			sb->count = last > root ? last - 1 : root;
+		} else if (!up || joined.items[0] != '/') {
+			if (sb->count > root)
+				ape_da_append(sb, '/');
+			ape_da_append_many(sb, p, len);
+		}
+		p += len;
+	}
+	ape_da_free(joined);
 }
 
-ApeCmd ape_gen_link_command(char *outfilename, char **srcfilenames, size_t len,
-			    uint16_t flags, ApeStrList args)
+/* Moves the object a batch compiled for job to its output, and rewrites the
+ * depfile that came with it relative to our directory */
+int ape__batch_collect(ApeJob *job)
 {
-	ApeCmd cmd = { 0 };
-	char **objfilenames = malloc(len);
-	for (size_t i = 0; i < len; i++) {
-		objfilenames[i] = ape_objfile_name(srcfilenames[i]);
-	}
-	ape_cmd_append(&cmd, APELD);
-	for (size_t i = 0; i < args.count; i++) {
-		ape_cmd_append(&cmd, args.items[i]);
+	const char *slash = strrchr(job->batch_obj, '/');
+	char *dir = ape_arena_strndup(&ape__arena, job->batch_obj,
+				      slash ? slash - job->batch_obj + 1 : 0);
+	ApeStrBuilder depfile = { 0 };
+	ape_da_append_many(&depfile, job->batch_obj,
+			   strlen(job->batch_obj) - strlen(APE_OBJ_EXTENSION));
+	ape_sb_append_str(&depfile, APE_DEP_EXTENSION);
+	ape_da_append(&depfile, 0);
+	int ok = 1;
+	if (rename(job->batch_obj, job->output) != 0) {
+		fprintf(stderr, "ERROR: Could not move %s to %s: %s\n",
+			job->batch_obj, job->output, strerror(errno));
+		ok = 0;
 	}
-	ApeStrBuilder sb = { 0 };
-	ape_sb_append_str(&sb, APE_OUTPUT_DIR);
-	if ((flags >> APE_FLAG_SHARED_LIB) & 1) {
-#ifndef APE_LIB_PREFIX
-#pragma GCC warning \
-	"You should define APE_LIB_PREFIX if you are building libraries"
-#else
-		ape_sb_append_str(&sb, APE_LIB_PREFIX);
-#endif
-		ape_sb_append_str(&sb, outfilename);
-#ifndef APE_LIB_SUFFIX
-#pragma GCC warning \
-	"You should define APE_LIB_SUFFIX if you are building libraries"
-#else
-		ape_sb_append_str(&sb, APE_LIB_SUFFIX);
-#endif
-		ape_da_append(&sb, 0);
-		ape_cmd_append(&cmd, APE_LINK_ARGS_SHARED_LIB(sb.items));
-	} else {
-		ape_sb_append_str(&sb, outfilename);
-		ape_da_append(&sb, 0);
-		ape_cmd_append(&cmd, APE_LINK_ARGS(sb.items));
+	ape_stat_cache_invalidate(job->output);
+	ApeStrList deps = { 0 };
+	if (ok && job->depfile && !ape_parse_depfile(depfile.items, &deps)) {
+		fprintf(stderr, "ERROR: Could not read %s: %s\n",
+			depfile.items, strerror(errno));
+		ok = 0;
 	}
-	if (!(ape_needs_rebuild(sb.items, objfilenames, len) ||
-	      ((flags >> APE_FLAG_REBUILD) & 1)))
-		return (ApeCmd){ 0 };
-	for (size_t i = 0; i < len; i++) {
-		ape_cmd_append(&cmd, ape_objfile_name(srcfilenames[i]));
+	if (ok && job->depfile) {
+		ApeStrBuilder content = { 0 };
+		ApeStrBuilder path = { 0 };
+		ape_sb_append_str(&content, job->output);
+		ape_da_append(&content, ':');
+		for (size_t i = 0; i < deps.count; i++) {
+			path.count = 0;
+			ape__path_resolve(&path, dir, deps.items[i]);
+			ape_sb_append_str(&content, " \\\n ");
+			for (size_t j = 0; j < path.count; j++) {
+				char c = path.items[j];
+				if (c == ' ' || c == '#')
+					ape_da_append(&content, '\\');
+				else if (c == '$')
+					ape_da_append(&content, '$');
+				ape_da_append(&content, c);
+			}
+		}
+		ape_da_append(&content, '\n');
+		FILE *f = fopen(job->depfile, "wb");
+		ok = f && fwrite(content.items, 1, content.count, f) ==
+				  content.count;
+		if (f)
+			ok = fclose(f) == 0 && ok;
+		if (!ok)
+			fprintf(stderr, "ERROR: Could not write %s: %s\n",
+				job->depfile, strerror(errno));
+		ape_da_free(path);
+		ape_da_free(content);
 	}
-	return cmd;
+	unlink(depfile.items);
+	ape_da_free(deps);
+	ape_da_free(depfile);
+	return ok;
 }
 
+/*
+ * GNU make jobserver. Every process in a build owns one implicit job slot and
+ * has to take a token (a single byte) from the jobserver for each command it
+ * runs beyond that, and put it back when the command is done. If apebuild is
+ * started from make it uses the jobserver named in MAKEFLAGS, either a fifo
+ * or a pair of inherited pipe fds. Otherwise it creates a fifo with -j - 1
+ * tokens itself and exports it, so that nested builds and
+ * gcc -flto=jobserver share the same budget.
+ */
 struct {
-	size_t capacity;
-	size_t count;
-	ApeBuilder *items;
-} ape__builder_list;
+	int rfd;
+	int wfd;
+	char *fifo;
+	/* MAKEFLAGS before the fifo was exported, NULL if it was unset */
+	char *makeflags;
+	/* Tokens taken for the commands currently running */
+	ApeStrBuilder tokens;
+} ape__jobserver = { .rfd = -1, .wfd = -1 };
 
-ApeCmdList ape_builder_gen_commands(ApeBuilder *builder)
-{
-	ApeCmdList cl = { 0 };
-	for (size_t i = 0; i < builder->infiles.count; i++) {
-		ApeCmd c = ape_gen_build_command(builder->infiles.items[i],
-						 builder->flags,
-						 builder->extra_build_args);
-		if (c.items)
-			ape_da_append(&cl, c);
-	}
-	ApeCmd c = ape_gen_link_command(builder->outfile,
-					builder->infiles.items,
-					builder->infiles.count, builder->flags,
-					builder->extra_link_args);
-	if (c.items)
-		ape_da_append(&cl, c);
-	return cl;
-}
+/* Written to by the SIGCHLD handler, so that waiting for a token can also be
+ * woken up by a command exiting */
+int ape__sigchld_pipe[2] = { -1, -1 };
 
-void ape_builder_append_file(ApeBuilder *builder, char *path)
+/* Opens fd again with a file description of our own, so that it can be made
+ * non-blocking without affecting make, which shares the original one */
+int ape__jobserver_reopen(int fd, int flags)
 {
-	ape_da_append(&builder->infiles, path);
+	if (fcntl(fd, F_GETFD) < 0)
+		return -1;
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	return open(path, flags | O_NONBLOCK | O_CLOEXEC);
 }
 
-int ape_builder_append_dir(ApeBuilder *builder, char *path)
+int ape__jobserver_client(const char *makeflags)
 {
-	DIR *dir = opendir(path);
-	struct dirent *entry;
-	if (!dir) {
-		fprintf(stderr, "ERROR: Could not open directory %s\n", path);
+	const char *auth = NULL;
+	const char *p = makeflags;
+	/* The last option wins, like in make */
+	while ((p = strstr(p, "--jobserver-")) != NULL) {
+		if (strncmp(p, "--jobserver-auth=", 17) == 0)
+			auth = p + 17;
+		else if (strncmp(p, "--jobserver-fds=", 16) == 0)
+			auth = p + 16;
+		p++;
+	}
+	if (!auth)
+		return 0;
+	size_t len = strcspn(auth, " ");
+	if (strncmp(auth, "fifo:", 5) == 0) {
+		char *path = strndup(auth + 5, len - 5);
+		ape__jobserver.rfd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		ape__jobserver.wfd = ape__jobserver.rfd;
+		if (ape__jobserver.rfd < 0)
+			fprintf(stderr,
+				"WARNING: Could not open jobserver fifo %s: %s\n",
+				path, strerror(errno));
+		free(path);
+	} else {
+		int r = -1, w = -1;
+		if (sscanf(auth, "%d,%d", &r, &w) == 2) {
+			ape__jobserver.rfd =
+				ape__jobserver_reopen(r, O_RDONLY);
+			ape__jobserver.wfd =
+				ape__jobserver_reopen(w, O_WRONLY);
+		}
+		if (ape__jobserver.rfd < 0 || ape__jobserver.wfd < 0) {
+			fprintf(stderr,
+				"WARNING: Jobserver unavailable, using -j1. "
+				"Add '+' to the parent make rule\n");
+			if (ape__jobserver.rfd >= 0)
+				close(ape__jobserver.rfd);
+			if (ape__jobserver.wfd >= 0)
+				close(ape__jobserver.wfd);
+			ape__jobserver.rfd = ape__jobserver.wfd = -1;
+		}
+	}
+	return 1;
+}
+
+int ape__jobserver_server(size_t njobs)
+{
+	const char *tmp = getenv("TMPDIR");
+	ApeStrBuilder sb = { 0 };
+	ape_sb_append_str(&sb, tmp && *tmp ? tmp : "/tmp");
+	char name[64];
+	snprintf(name, sizeof(name), "/apebuild-jobserver-%d", (int)getpid());
+	ape_sb_append_str(&sb, name);
+	ape_da_append(&sb, 0);
+	unlink(sb.items);
+	if (mkfifo(sb.items, 0600) < 0) {
+		fprintf(stderr, "WARNING: Could not create jobserver %s: %s\n",
+			sb.items, strerror(errno));
+		ape_da_free(sb);
+		return 0;
+	}
+	int fd = open(sb.items, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		unlink(sb.items);
+		ape_da_free(sb);
+		return 0;
+	}
+	for (size_t i = 1; i < njobs; i++) {
+		if (write(fd, "+", 1) != 1) {
+			fprintf(stderr,
+				"WARNING: Could not fill jobserver: %s\n",
+				strerror(errno));
+			break;
+		}
+	}
+	ape__jobserver.rfd = ape__jobserver.wfd = fd;
+	ape__jobserver.fifo = sb.items;
+
+	ApeStrBuilder flags = { 0 };
+	const char *old = getenv("MAKEFLAGS");
+	ape__jobserver.makeflags = old ? strdup(old) : NULL;
+	if (old)
+		ape_sb_append_str(&flags, old);
+	char auth[64];
+	snprintf(auth, sizeof(auth), " -j%zu --jobserver-auth=fifo:", njobs);
+	ape_sb_append_str(&flags, auth);
+	ape_sb_append_str(&flags, sb.items);
+	ape_da_append(&flags, 0);
+	setenv("MAKEFLAGS", flags.items, 1);
+	ape_da_free(flags);
+	return 1;
+}
+
+/* Joins the jobserver of a parent make or build, or becomes one for njobs
+ * commands. Returns 0 if the commands have to be limited to one at a time */
+int ape_jobserver_open(size_t njobs)
+{
+	const char *makeflags = getenv("MAKEFLAGS");
+	if (makeflags && ape__jobserver_client(makeflags))
+		return ape__jobserver.rfd >= 0;
+	if (njobs > 1)
+		ape__jobserver_server(njobs);
+	return 1;
+}
+
+void ape_jobserver_close(void)
+{
+	/* Tokens of commands that never finished still belong to the pool */
+	if (ape__jobserver.wfd >= 0 && ape__jobserver.tokens.count > 0 &&
+	    write(ape__jobserver.wfd, ape__jobserver.tokens.items,
+		  ape__jobserver.tokens.count) < 0)
+		fprintf(stderr, "WARNING: Could not return jobserver tokens\n");
+	ape__jobserver.tokens.count = 0;
+	if (ape__jobserver.wfd >= 0 && ape__jobserver.wfd != ape__jobserver.rfd)
+		close(ape__jobserver.wfd);
+	if (ape__jobserver.rfd >= 0)
+		close(ape__jobserver.rfd);
+	ape__jobserver.rfd = ape__jobserver.wfd = -1;
+	if (ape__jobserver.fifo) {
+		unlink(ape__jobserver.fifo);
+		free(ape__jobserver.fifo);
+		ape__jobserver.fifo = NULL;
+		/* Commands started later, or this process after an exec,
+		 * would look for the fifo */
+		if (ape__jobserver.makeflags)
+			setenv("MAKEFLAGS", ape__jobserver.makeflags, 1);
+		else
+			unsetenv("MAKEFLAGS");
+		free(ape__jobserver.makeflags);
+		ape__jobserver.makeflags = NULL;
+	}
+	ape_da_free(ape__jobserver.tokens);
+	memset(&ape__jobserver.tokens, 0, sizeof(ape__jobserver.tokens));
+}
+
+/* Takes a token without blocking, returns whether there was one */
+int ape__jobserver_acquire(void)
+{
+	char token;
+	if (read(ape__jobserver.rfd, &token, 1) != 1)
+		return 0;
+	ape_da_append(&ape__jobserver.tokens, token);
+	return 1;
+}
+
+void ape__jobserver_release(void)
+{
+	char token =
+		ape__jobserver.tokens.items[--ape__jobserver.tokens.count];
+	while (write(ape__jobserver.wfd, &token, 1) < 0 && errno == EINTR)
+		;
+}
+
+void ape__sigchld(int sig)
+{
+	(void)sig;
+	int saved = errno;
+	if (write(ape__sigchld_pipe[1], "", 1) < 0) {
+		/* The pipe is full, a wakeup is already pending */
+	}
+	errno = saved;
+}
+
+
+/* Memory budget of the scheduler in bytes, set with -m or --mem-budget. 0
+ * means no limit, -1 to take what is available when the build starts */
+int64_t ape__mem_budget = 0;
+
+/* Whether the build was told that the budget holds jobs back */
+int ape__mem_held = 0;
+
+#ifndef APE_JOB_MEM_DEFAULT
+#define APE_JOB_MEM_DEFAULT (256LL << 20)
+#endif
+
+int ape__read_small(const char *path, char *buf, size_t size)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	ssize_t n = read(fd, buf, size - 1);
+	close(fd);
+	if (n < 0)
+		return 0;
+	buf[n] = 0;
+	return 1;
+}
+
+/* Bytes of memory the build can still use, the smallest of MemAvailable and
+ * the room left under the memory.max of this cgroup and its parents (cgroup
+ * v2 only). 0 if it can't be determined */
+int64_t ape__mem_available(void)
+{
+	char buf[4096];
+	int64_t avail = 0;
+	if (ape__read_small("/proc/meminfo", buf, sizeof(buf))) {
+		const char *p = strstr(buf, "MemAvailable:");
+		if (p)
+			avail = strtoll(p + 13, NULL, 10) * 1024;
+	}
+	if (!ape__read_small("/proc/self/cgroup", buf, sizeof(buf)))
+		return avail;
+	const char *line = strstr(buf, "0::");
+	if (line != buf && (!line || line[-1] != '\n'))
+		return avail;
+	const char *roots[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+	for (size_t r = 0; r < 2; r++) {
+		ApeStrBuilder dir = { 0 };
+		ape_sb_append_str(&dir, roots[r]);
+		ape_da_append_many(&dir, line + 3, strcspn(line + 3, "\n"));
+		while (dir.count > 0 && dir.items[dir.count - 1] == '/')
+			dir.count--;
+		size_t root_len = strlen(roots[r]);
+		/* Every ancestor's limit applies as well */
+		while (dir.count >= root_len) {
+			char max[64], current[64];
+			ApeStrBuilder file = { 0 };
+			ape_da_append_many(&file, dir.items, dir.count);
+			ape_sb_append_str(&file, "/memory.max");
+			ape_da_append(&file, 0);
+			int have_max = ape__read_small(file.items, max,
+						       sizeof(max));
+			file.count -= sizeof("max");
+			ape_sb_append_str(&file, "current");
+			ape_da_append(&file, 0);
+			int have_current = ape__read_small(file.items, current,
+							   sizeof(current));
+			ape_da_free(file);
+			if (have_max && have_current &&
+			    strncmp(max, "max", 3) != 0) {
+				int64_t room = strtoll(max, NULL, 10) -
+					       strtoll(current, NULL, 10);
+				if (room < 0)
+					room = 0;
+				if (avail == 0 || room < avail)
+					avail = room;
+			}
+			while (dir.count > root_len &&
+			       dir.items[dir.count - 1] != '/')
+				dir.count--;
+			if (dir.count == root_len)
+				break;
+			dir.count--;
+		}
+		ape_da_free(dir);
+	}
+	return avail;
+}
+
+/* Number of commands started by ape_jobs_run_parallel so far */
+size_t ape__jobs_started;
+
+void ape__forward_signal(int sig)
+{
+	ape__interrupted = sig;
+	for (sig_atomic_t i = 0; i < ape__nchildren; i++)
+		kill(-ape__children[i], sig);
+}
+
+typedef struct {
+	ApeJobList jobs;
+	size_t *pending;
+	size_t *dependents;
+	size_t *dependents_start;
+	/* Max-heap of the jobs that can be started, by priority */
+	size_t *ready;
+	size_t nready;
+	/* Estimated time from the start of a job to the end of the build */
+	int64_t *priority;
+	/* Expected peak memory use of every job */
+	int64_t *memory;
+	size_t done;
+} ApeSched;
+
+int ape__sched_before(ApeSched *s, size_t a, size_t b)
+{
+	if (s->priority[a] != s->priority[b])
+		return s->priority[a] > s->priority[b];
+	return a < b;
+}
+
+void ape__sched_push(ApeSched *s, size_t job)
+{
+	size_t i = s->nready++;
+	while (i > 0 && ape__sched_before(s, job, s->ready[(i - 1) / 2])) {
+		s->ready[i] = s->ready[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	s->ready[i] = job;
+}
+
+size_t ape__sched_pop(ApeSched *s)
+{
+	size_t top = s->ready[0];
+	size_t job = s->ready[--s->nready];
+	size_t i = 0;
+	for (;;) {
+		size_t child = 2 * i + 1;
+		if (child >= s->nready)
+			break;
+		if (child + 1 < s->nready &&
+		    ape__sched_before(s, s->ready[child + 1], s->ready[child]))
+			child++;
+		if (!ape__sched_before(s, s->ready[child], job))
+			break;
+		s->ready[i] = s->ready[child];
+		i = child;
+	}
+	s->ready[i] = job;
+	return top;
+}
+
+/* Marks a job as done and queues the dependents that were waiting on it */
+void ape__sched_release(ApeSched *s, size_t job)
+{
+	s->done++;
+	for (size_t i = s->dependents_start[job];
+	     i < s->dependents_start[job + 1]; i++) {
+		ApeJob *dependent = &s->jobs.items[s->dependents[i]];
+		if (s->jobs.items[job].changed)
+			dependent->lazy = 0;
+		if (--s->pending[s->dependents[i]] == 0)
+			ape__sched_push(s, s->dependents[i]);
+	}
+}
+
+/* Rough cost of a compile per byte of source and of a link per input, for
+ * jobs that have never been timed */
+#define APE__EST_NS_PER_BYTE 20000
+#define APE__EST_LINK_NS 50000000
+#define APE__EST_LINK_INPUT_NS 1000000
+
+/* Sets the priority of every job to the length of the longest chain of
+ * jobs from it to the end of the build, using the durations from the last
+ * build and estimates for the rest. Starting the jobs on the critical path
+ * first keeps a long compile from being started last */
+void ape__sched_prioritize(ApeSched *s)
+{
+	ApeJobList jobs = s->jobs;
+	int64_t *cost = calloc(jobs.count + 1, sizeof(int64_t));
+	/* Scale the size estimate by how long known compiles took */
+	double known_ns = 0, known_bytes = 0;
+	for (size_t i = 0; i < jobs.count; i++) {
+		ApeJob *job = &jobs.items[i];
+		cost[i] = job->output ? ape_log_duration(job->output) : 0;
+		if (!cost[i] || !ape__job_compiles(job) ||
+		    job->inputs_count == 0)
+			continue;
+		const struct stat *st = ape_stat_cached(job->inputs[0]);
+		if (st && st->st_size > 0) {
+			known_ns += cost[i];
+			known_bytes += st->st_size;
+		}
+	}
+	double ns_per_byte = known_bytes > 0 ? known_ns / known_bytes :
+					       APE__EST_NS_PER_BYTE;
+	for (size_t i = 0; i < jobs.count; i++) {
+		ApeJob *job = &jobs.items[i];
+		if (cost[i])
+			continue;
+		if (ape__job_compiles(job) && job->inputs_count > 0) {
+			const struct stat *st = ape_stat_cached(job->inputs[0]);
+			cost[i] = (int64_t)((st ? st->st_size : 0) * ns_per_byte);
+		} else {
+			cost[i] = APE__EST_LINK_NS +
+				  job->inputs_count * APE__EST_LINK_INPUT_NS;
+		}
+		if (cost[i] < 1)
+			cost[i] = 1;
+	}
+	/* A batch takes as long as its compiles, which then only take their
+	 * outputs */
+	for (size_t i = 0; i < jobs.count; i++) {
+		if (jobs.items[i].kind != APE_JOB_BATCH)
+			continue;
+		cost[i] = 0;
+		for (size_t j = s->dependents_start[i];
+		     j < s->dependents_start[i + 1]; j++) {
+			size_t dep = s->dependents[j];
+			if (!jobs.items[dep].batch_obj)
+				continue;
+			cost[i] += cost[dep];
+			cost[dep] = 1;
+		}
+	}
+
+	/* Walk the graph backwards in topological order, so the priorities of
+	 * all dependents are known before the job itself */
+	size_t *order = malloc((jobs.count + 1) * sizeof(size_t));
+	size_t *pending = malloc((jobs.count + 1) * sizeof(size_t));
+	memcpy(pending, s->pending, jobs.count * sizeof(size_t));
+	size_t head = 0, tail = 0;
+	for (size_t i = 0; i < jobs.count; i++)
+		if (pending[i] == 0)
+			order[tail++] = i;
+	while (head < tail) {
+		size_t job = order[head++];
+		for (size_t i = s->dependents_start[job];
+		     i < s->dependents_start[job + 1]; i++)
+			if (--pending[s->dependents[i]] == 0)
+				order[tail++] = s->dependents[i];
+	}
+	for (size_t i = 0; i < jobs.count; i++)
+		s->priority[i] = cost[i];
+	while (tail > 0) {
+		size_t job = order[--tail];
+		int64_t longest = 0;
+		for (size_t i = s->dependents_start[job];
+		     i < s->dependents_start[job + 1]; i++)
+			if (s->priority[s->dependents[i]] > longest)
+				longest = s->priority[s->dependents[i]];
+		s->priority[job] = cost[job] + longest;
+	}
+	free(order);
+	free(pending);
+	free(cost);
+}
+
+/* Expects jobs to need as much memory as last time, and jobs that haven't
+ * been measured yet as much as the average of the others */
+void ape__sched_estimate_memory(ApeSched *s)
+{
+	int64_t known = 0;
+	size_t nknown = 0;
+	for (size_t i = 0; i < s->jobs.count; i++) {
+		ApeJob *job = &s->jobs.items[i];
+		s->memory[i] = job->output ? ape_log_max_rss(job->output) : 0;
+		if (s->memory[i]) {
+			known += s->memory[i];
+			nknown++;
+		}
+	}
+	int64_t guess = nknown ? known / nknown : APE_JOB_MEM_DEFAULT;
+	for (size_t i = 0; i < s->jobs.count; i++)
+		if (!s->memory[i])
+			s->memory[i] = guess;
+	/* The compiles of a batch run one after the other */
+	for (size_t i = 0; i < s->jobs.count; i++) {
+		if (s->jobs.items[i].kind != APE_JOB_BATCH)
+			continue;
+		s->memory[i] = 0;
+		for (size_t j = s->dependents_start[i];
+		     j < s->dependents_start[i + 1]; j++)
+			if (s->memory[s->dependents[j]] > s->memory[i])
+				s->memory[i] = s->memory[s->dependents[j]];
+	}
+}
+
+/* Remote compiles: compiles that don't need anything but their source are
+ * preprocessed locally and compiled by apebuild-worker daemons, reached over
+ * TCP ("host:port") or Unix sockets (a path). A compile the scheduler gives
+ * to a worker runs as the build binary itself with APE__REMOTE_ARG, which
+ * preprocesses the source, sends it and writes the object it gets back, or
+ * falls back to the local command if the worker fails. Messages are lists of
+ * fields, each a 32 bit big endian length followed by its bytes */
+#define APE__REMOTE_ARG "--apebuild-remote"
+#define APE__REMOTE_MAGIC "apebuild-remote 1"
+
+#ifndef APE_WORKER_ADDR
+#define APE_WORKER_ADDR "127.0.0.1:7420"
+#endif
+/* Largest preprocessed source or object sent, and largest other field */
+#ifndef APE_REMOTE_MAX_SIZE
+#define APE_REMOTE_MAX_SIZE (256U << 20)
+#endif
+#define APE__REMOTE_MAX_FIELD (64U << 10)
+#define APE__REMOTE_MAX_FLAGS 4096
+/* Longest magic or request type, and how long a worker waits for them */
+#define APE__REMOTE_MAX_HANDSHAKE 32
+#define APE__REMOTE_HANDSHAKE_TIMEOUT_NS 10000000000LL
+#define APE__REMOTE_MAX_PENDING 256
+
+typedef struct {
+	const char *addr;
+	/* Compiles it runs at once, 0 if it can't be reached */
+	int slots;
+	/* Compiles of other builds on it when it was last asked, and ours */
+	int load;
+	int running;
+	int64_t polled;
+} ApeWorker;
+
+typedef struct {
+	size_t capacity;
+	size_t count;
+	ApeWorker *items;
+} ApeWorkerList;
+
+ApeWorkerList ape__remote_workers;
+/* Set once the build binary can run remote compiles, see ape__rebuild */
+int ape__remote_entry;
+
+#ifdef APE_REMOTE_WORKERS
+const char *ape__remote_addrs = APE_REMOTE_WORKERS;
+#else
+const char *ape__remote_addrs = NULL;
+#endif
+
+int ape__read_file(const char *path, ApeStrBuilder *sb)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return 0;
+	char buf[1 << 16];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		ape_da_append_many(sb, buf, n);
+	int ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+int ape__write_file(const char *path, const char *data, size_t n)
+{
+	FILE *f = fopen(path, "wb");
+	int ok = f && fwrite(data, 1, n, f) == n;
+	if (f)
+		ok = fclose(f) == 0 && ok;
+	return ok;
+}
+
+/* Connects to a worker, giving up after timeout_ms. Returns the socket or
+ * -1 */
+int ape__remote_connect(const char *addr, int timeout_ms)
+{
+	struct addrinfo *res = NULL;
+	struct sockaddr_un un = { .sun_family = AF_UNIX };
+	if (strchr(addr, '/')) {
+		if (strlen(addr) >= sizeof(un.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(un.sun_path, addr);
+	} else {
+		const char *colon = strrchr(addr, ':');
+		if (!colon) {
+			errno = EINVAL;
+			return -1;
+		}
+		char host[256];
+		snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+		struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+		if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+			errno = EHOSTUNREACH;
+			return -1;
+		}
+	}
+	int family = res ? res->ai_family : AF_UNIX;
+	const struct sockaddr *sa = res ? res->ai_addr :
+					  (const struct sockaddr *)&un;
+	socklen_t len = res ? res->ai_addrlen : sizeof(un);
+	int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	int ok = fd >= 0;
+	if (ok && connect(fd, sa, len) != 0) {
+		ok = errno == EINPROGRESS;
+		struct pollfd p = { .fd = fd, .events = POLLOUT };
+		int err = 0;
+		socklen_t errlen = sizeof(err);
+		if (ok && poll(&p, 1, timeout_ms) != 1) {
+			errno = ETIMEDOUT;
+			ok = 0;
+		}
+		if (ok && (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err,
+				      &errlen) != 0 ||
+			   err != 0)) {
+			errno = err;
+			ok = 0;
+		}
+	}
+	if (res)
+		freeaddrinfo(res);
+	if (!ok) {
+		int err = errno;
+		if (fd >= 0)
+			close(fd);
+		errno = err;
+		return -1;
+	}
+	fcntl(fd, F_SETFL, 0);
+	return fd;
+}
+
+int ape__remote_send(int fd, const void *data, size_t n)
+{
+	if (n > UINT32_MAX)
+		return 0;
+	unsigned char len[4] = { n >> 24, n >> 16, n >> 8, n };
+	const char *p = data;
+	for (size_t done = 0; done < 4 + n;) {
+		ssize_t r = done < 4 ?
+				    send(fd, len + done, 4 - done, MSG_NOSIGNAL) :
+				    send(fd, p + done - 4, n + 4 - done,
+					 MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return 0;
+		done += r;
+	}
+	return 1;
+}
+
+int ape__remote_send_str(int fd, const char *s)
+{
+	return ape__remote_send(fd, s, strlen(s));
+}
+
+int ape__remote_recv_all(int fd, void *buf, size_t n)
+{
+	for (size_t done = 0; done < n;) {
+		ssize_t r = recv(fd, (char *)buf + done, n - done, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return 0;
+		done += r;
+	}
+	return 1;
+}
+
+/* Receives a field of at most max bytes into sb, which is NUL terminated
+ * without counting it */
+int ape__remote_recv(int fd, ApeStrBuilder *sb, size_t max)
+{
+	unsigned char len[4];
+	if (!ape__remote_recv_all(fd, len, 4))
+		return 0;
+	size_t n = (size_t)len[0] << 24 | (size_t)len[1] << 16 |
+		   (size_t)len[2] << 8 | len[3];
+	if (n > max)
+		return 0;
+	sb->count = 0;
+	if (sb->capacity < n + 1) {
+		char *items = realloc(sb->items, n + 1);
+		if (!items)
+			return 0;
+		sb->items = items;
+		sb->capacity = n + 1;
+	}
+	if (!ape__remote_recv_all(fd, sb->items, n))
+		return 0;
+	sb->count = n;
+	sb->items[n] = '\0';
+	return 1;
+}
+
+/* Asks a worker for its slots and load */
+void ape__remote_stat(ApeWorker *w)
+{
+	w->polled = ape__now_ns();
+	int fd = ape__remote_connect(w->addr, 200);
+	/* The scheduler waits on this, a worker that doesn't answer is
+	 * unavailable */
+	struct timeval timeout = { .tv_usec = 500000 };
+	if (fd >= 0) {
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			   sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+			   sizeof(timeout));
+	}
+	ApeStrBuilder sb = { 0 };
+	int slots = 0, load = 0;
+	int ok = fd >= 0 && ape__remote_send_str(fd, APE__REMOTE_MAGIC) &&
+		 ape__remote_send_str(fd, "stat") &&
+		 ape__remote_recv(fd, &sb, APE__REMOTE_MAX_FIELD) &&
+		 sscanf(sb.items, "%d %d", &slots, &load) == 2 && slots > 0;
+	if (fd >= 0)
+		close(fd);
+	ape_da_free(sb);
+	if (!ok && w->slots > 0)
+		fprintf(stderr, "WARNING: Worker %s is unavailable\n", w->addr);
+	w->slots = ok ? slots : 0;
+	/* Its load counts our own compiles too */
+	w->load = ok && load > w->running ? load - w->running : 0;
+}
+
+/* Connects to the workers in the comma separated list addrs. Returns the
+ * number of compiles they can run at once */
+size_t ape__remote_open(const char *addrs)
+{
+	char *list = ape_arena_strndup(&ape__arena, addrs, strlen(addrs));
+	size_t slots = 0;
+	for (char *addr = strtok(list, ","); addr; addr = strtok(NULL, ",")) {
+		ApeWorker w = { .addr = addr, .slots = 1 };
+		ape__remote_stat(&w);
+		slots += w.slots;
+		ape_da_append(&ape__remote_workers, w);
+	}
+	if (slots > 0 && !ape__remote_entry)
+		fprintf(stderr, "WARNING: Remote compiles need APEBUILD_MAIN "
+				"or APE_REBUILD, compiling locally\n");
+	return ape__remote_entry ? slots : 0;
+}
+
+/* Picks the least loaded worker with a free slot for job, if there is one.
+ * Loads are asked again at most once a second, and unavailable workers
+ * every ten seconds */
+int ape__remote_pick(ApeJob *job)
+{
+	if (!job->remote_flags || !ape__remote_entry)
+		return 0;
+	int64_t now = ape__now_ns();
+	ApeWorker *best = NULL;
+	for (size_t i = 0; i < ape__remote_workers.count; i++) {
+		ApeWorker *w = &ape__remote_workers.items[i];
+		int64_t interval = w->slots > 0 ? 1000000000LL :
+						  10000000000LL;
+		if (now - w->polled > interval)
+			ape__remote_stat(w);
+		if (w->load + w->running >= w->slots)
+			continue;
+		if (!best || (int64_t)(w->load + w->running) * best->slots <
+				     (int64_t)(best->load + best->running) *
+					     w->slots)
+			best = w;
+	}
+	if (!best)
+		return 0;
+	best->running++;
+	job->worker = best - ape__remote_workers.items + 1;
+	return 1;
+}
+
+void ape__remote_done(ApeJob *job)
+{
+	if (job->worker)
+		ape__remote_workers.items[job->worker - 1].running--;
+	job->worker = 0;
+}
+
+/* The command that runs job on its worker through the build binary */
+ApeCmd ape__remote_cmd(const ApeJob *job)
+{
+	char flags[32];
+	snprintf(flags, sizeof(flags), "%zu", job->remote_flags);
+	ApeCmd cmd = { 0 };
+	ape_cmd_append(&cmd, "/proc/self/exe", APE__REMOTE_ARG,
+		       ape__remote_workers.items[job->worker - 1].addr,
+		       ape_intern(flags), job->inputs[0], job->output,
+		       job->depfile ? job->depfile : "");
+	ape_da_append_many(&cmd, job->cmd.items, job->cmd.count);
+	return cmd;
+}
+
+#ifdef APE_BUILD_PREPROCESS_ARGS
+char *ape__path_with_ext(const char *path, const char *ext);
+
+/* Runs a remote compile, argv is the command of ape__remote_cmd. Returns
+ * the exit status of the compile */
+int ape__remote_client(int argc, char **argv)
+{
+	if (argc < 8)
+		return 2;
+	const char *addr = argv[2];
+	size_t nflags = strtoul(argv[3], NULL, 10);
+	const char *src = argv[4];
+	char *obj = argv[5];
+	const char *depfile = argv[6];
+	ApeCmd local = { 0 };
+	ape_da_append_many(&local, (const char **)argv + 7, argc - 7);
+	if (nflags < 1 || nflags > local.count)
+		return 2;
+
+	/* Preprocessing stays here, where the headers are */
+	char *ifile = ape__path_with_ext(obj, APE_PREPROCESSED_EXTENSION);
+	ApeCmd pre = { 0 };
+	ape_da_append_many(&pre, local.items, nflags);
+#ifdef APE_BUILD_DEPFILE_ARGS
+	if (*depfile)
+		ape_cmd_append(&pre, APE_BUILD_DEPFILE_ARGS(depfile));
+#else
+	(void)depfile;
+#endif
+	ape_cmd_append(&pre, APE_BUILD_PREPROCESS_ARGS(src, ifile));
+	int wstatus = 0;
+	ApeProc p = ape__spawn(pre, NULL, NULL, -1, 0);
+	if (p == APE_INVALID_PROC)
+		return 1;
+	while (waitpid(p, &wstatus, 0) < 0 && errno == EINTR)
+		;
+	if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+		unlink(ifile);
+		return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 1;
+	}
+	ApeStrBuilder source = { 0 };
+	int ok = ape__read_file(ifile, &source);
+	unlink(ifile);
+
+	char cwd[PATH_MAX];
+	char count[32];
+	snprintf(count, sizeof(count), "%zu", nflags);
+	int fd = ok && getcwd(cwd, sizeof(cwd)) ?
+			 ape__remote_connect(addr, 1000) :
+			 -1;
+	ok = fd >= 0 && ape__remote_send_str(fd, APE__REMOTE_MAGIC) &&
+	     ape__remote_send_str(fd, "compile") &&
+	     ape__remote_send_str(fd, cwd) && ape__remote_send_str(fd, ifile) &&
+	     ape__remote_send_str(fd, count);
+	for (size_t i = 0; ok && i < nflags; i++)
+		ok = ape__remote_send_str(fd, local.items[i]);
+	ok = ok && ape__remote_send(fd, source.items, source.count);
+	ApeStrBuilder status = { 0 };
+	ApeStrBuilder output = { 0 };
+	ApeStrBuilder object = { 0 };
+	ok = ok && ape__remote_recv(fd, &status, APE__REMOTE_MAX_FIELD) &&
+	     ape__remote_recv(fd, &output, APE_REMOTE_MAX_SIZE) &&
+	     ape__remote_recv(fd, &object, APE_REMOTE_MAX_SIZE);
+	if (fd >= 0)
+		close(fd);
+	/* Anything but the compile itself failing falls back to compiling
+	 * here */
+	int exit_status = ok ? atoi(status.items) : -1;
+	if (exit_status == 0 &&
+	    !ape__write_file(obj, object.items, object.count))
+		exit_status = -1;
+	if (exit_status < 0) {
+		fprintf(stderr, "WARNING: Compiling %s locally, worker %s "
+				"failed%s%.*s\n",
+			src, addr, ok ? ": " : "", ok ? (int)output.count : 0,
+			output.items ? output.items : "");
+		unlink(obj);
+		const char **cmd = calloc(local.count + 1, sizeof(char *));
+		memcpy(cmd, local.items, local.count * sizeof(char *));
+		execvp(cmd[0], (char *const *)cmd);
+		fprintf(stderr, "ERROR: Could not exec child process %s: %s\n",
+			cmd[0], strerror(errno));
+		return 127;
+	}
+	fwrite(output.items, 1, output.count, stderr);
+	return exit_status;
+}
+#endif
+
+/* Whether the include directory path of a request, made in the directory
+ * cwd, stays under it */
+int ape__worker_path_ok(const char *cwd, const char *path)
+{
+	size_t n = strlen(cwd);
+	if (*path == '/') {
+		if (strncmp(path, cwd, n) != 0 ||
+		    (path[n] != '/' && path[n] != '\0'))
+			return 0;
+		path += n;
+	}
+	for (const char *p = path; *p; p++) {
+		if (p[0] == '.' && p[1] == '.' && (p == path || p[-1] == '/') &&
+		    (p[2] == '/' || p[2] == '\0'))
+			return 0;
+	}
+	return 1;
+}
+
+/* Whether the compiler flags of a request can run on a worker. Anything that
+ * can load code, or read or write files other than its own, is refused: the
+ * flags come from whoever connects */
+int ape__worker_flags_ok(const char *cwd, ApeCmd cmd)
+{
+	static const char *denied[] = { "-fplugin", "-fdump", "-fopt-info",
+					"-fprofile", "-fauto-profile",
+					"-fcallgraph-info", "-fstack-usage",
+					"-fsave-optimization-record" };
+	for (size_t i = 1; i < cmd.count; i++) {
+		const char *f = cmd.items[i];
+		if (strcmp(f, "-D") == 0 || strcmp(f, "-U") == 0 ||
+		    strcmp(f, "-I") == 0) {
+			if (++i >= cmd.count)
+				return 0;
+			if (f[1] == 'I' &&
+			    !ape__worker_path_ok(cwd, cmd.items[i]))
+				return 0;
+			continue;
+		}
+		if (strncmp(f, "-I", 2) == 0) {
+			if (!ape__worker_path_ok(cwd, f + 2))
+				return 0;
+			continue;
+		}
+		if (strncmp(f, "-f", 2) == 0) {
+			size_t count = sizeof(denied) / sizeof(denied[0]);
+			for (size_t k = 0; k < count; k++)
+				if (strncmp(f, denied[k], strlen(denied[k])) ==
+				    0)
+					return 0;
+			continue;
+		}
+		/* -Wp, -Wa and -Wl pass anything on */
+		if (strncmp(f, "-W", 2) == 0 && (f[2] == '\0' || f[3] != ','))
+			continue;
+		if (strncmp(f, "-D", 2) == 0 || strncmp(f, "-U", 2) == 0 ||
+		    strncmp(f, "-O", 2) == 0 || strncmp(f, "-g", 2) == 0 ||
+		    strncmp(f, "-m", 2) == 0 || strncmp(f, "-std=", 5) == 0 ||
+		    strncmp(f, "-pedantic", 9) == 0 ||
+		    strcmp(f, "-pthread") == 0 || strcmp(f, "-w") == 0)
+			continue;
+		return 0;
+	}
+	return 1;
+}
+
+/* Compiles the request on connection fd of a worker, in a directory of its
+ * own that the debug info maps to the directory of the build */
+void ape__worker_compile(int fd, ApeStrList compilers, int verbose)
+{
+	ApeStrBuilder cwd = { 0 };
+	ApeStrBuilder name = { 0 };
+	ApeStrBuilder field = { 0 };
+	ApeStrBuilder output = { 0 };
+	ApeStrBuilder object = { 0 };
+	ApeCmd cmd = { 0 };
+	char dir[] = "/tmp/apebuild-worker-XXXXXX";
+	char in[sizeof(dir) + 16], out[sizeof(dir) + 16], log[sizeof(dir) + 16];
+	const char *error = NULL;
+	int status = -1;
+	int ok = ape__remote_recv(fd, &cwd, APE__REMOTE_MAX_FIELD) &&
+		 ape__remote_recv(fd, &name, APE__REMOTE_MAX_FIELD) &&
+		 ape__remote_recv(fd, &field, APE__REMOTE_MAX_FIELD);
+	size_t nflags = ok ? strtoul(field.items, NULL, 10) : 0;
+	if (nflags > APE__REMOTE_MAX_FLAGS)
+		ok = 0;
+	for (size_t i = 0; ok && i < nflags; i++) {
+		ok = ape__remote_recv(fd, &field, APE__REMOTE_MAX_FIELD);
+		if (ok)
+			ape_da_append(&cmd, ape_arena_strndup(&ape__arena,
+							      field.items,
+							      field.count));
+	}
+	ok = ok && nflags > 0 && ape__remote_recv(fd, &field, APE_REMOTE_MAX_SIZE);
+	if (!ok)
+		goto done;
+	/* Only the compilers we were told to run */
+	int allowed = 0;
+	for (size_t i = 0; i < compilers.count; i++)
+		allowed |= strcmp(compilers.items[i], cmd.items[0]) == 0;
+	if (!allowed) {
+		error = "compiler not allowed";
+		goto done;
+	}
+	if (!ape__worker_flags_ok(cwd.items, cmd)) {
+		error = "compiler flags not allowed";
+		goto done;
+	}
+	if (!mkdtemp(dir)) {
+		error = strerror(errno);
+		goto done;
+	}
+	const char *ext = strrchr(name.items, '.');
+	snprintf(in, sizeof(in), "%s/in%s", dir, ext ? ext : "");
+	snprintf(out, sizeof(out), "%s/out" APE_OBJ_EXTENSION, dir);
+	snprintf(log, sizeof(log), "%s/log", dir);
+	if (verbose)
+		fprintf(stderr, "INFO: Compiling %s\n", name.items);
+	int logfd = open(log, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (logfd < 0 || !ape__write_file(in, field.items, field.count)) {
+		error = strerror(errno);
+	} else {
+#ifdef APE_BUILD_PREFIX_MAP_ARG
+		ApeStrBuilder map = { 0 };
+		ape_sb_append_str(&map, APE_BUILD_PREFIX_MAP_ARG);
+		ape_sb_append_str(&map, dir);
+		ape_da_append(&map, '=');
+		ape_sb_append_str(&map, cwd.items);
+		ape_cmd_append(&cmd, ape_arena_strndup(&ape__arena, map.items,
+						       map.count));
+		ape_da_free(map);
+#endif
+		ape_cmd_append(&cmd, APE_BUILD_SRC_ARGS(in, out));
+		ApeProc p = ape__spawn(cmd, NULL, NULL, logfd, 0);
+		int wstatus = 0;
+		if (p == APE_INVALID_PROC)
+			error = "could not run the compiler";
+		else
+			while (waitpid(p, &wstatus, 0) < 0 && errno == EINTR)
+				;
+		if (!error)
+			status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 1;
+		if (!ape__read_file(log, &output))
+			output.count = 0;
+		if (status == 0 && !ape__read_file(out, &object)) {
+			error = strerror(errno);
+			status = -1;
+		}
+	}
+	if (logfd >= 0)
+		close(logfd);
+	unlink(in);
+	unlink(out);
+	unlink(log);
+	rmdir(dir);
+done:
+	if (ok) {
+		char s[32];
+		snprintf(s, sizeof(s), "%d", error ? -1 : status);
+		if (error) {
+			output.count = 0;
+			ape_sb_append_str(&output, error);
+		}
+		ape__remote_send_str(fd, s);
+		ape__remote_send(fd, output.items, output.count);
+		ape__remote_send(fd, object.items, object.count);
+	}
+	ape_cmd_free(cmd);
+	ape_da_free(cwd);
+	ape_da_free(name);
+	ape_da_free(field);
+	ape_da_free(output);
+	ape_da_free(object);
+}
+
+/* Opens the listening socket of a worker at addr */
+int ape__worker_listen(const char *addr)
+{
+	struct sockaddr_un un = { .sun_family = AF_UNIX };
+	struct addrinfo *res = NULL;
+	if (strchr(addr, '/')) {
+		if (strlen(addr) >= sizeof(un.sun_path)) {
+			fprintf(stderr, "ERROR: Socket path too long: %s\n",
+				addr);
+			return -1;
+		}
+		strcpy(un.sun_path, addr);
+		unlink(addr);
+	} else {
+		const char *colon = strrchr(addr, ':');
+		char host[256];
+		snprintf(host, sizeof(host), "%.*s",
+			 colon ? (int)(colon - addr) : 0, addr);
+		struct addrinfo hints = { .ai_socktype = SOCK_STREAM,
+					  .ai_flags = AI_PASSIVE };
+		int err = getaddrinfo(*host ? host : NULL,
+				      colon ? colon + 1 : addr, &hints, &res);
+		if (err != 0) {
+			fprintf(stderr, "ERROR: Invalid address %s: %s\n", addr,
+				gai_strerror(err));
+			return -1;
+		}
+	}
+	int fd = socket(res ? res->ai_family : AF_UNIX,
+			SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int one = 1;
+	if (fd >= 0 && res)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	/* Only our own user can connect to the socket, before it listens */
+	int ok = fd >= 0 &&
+		 bind(fd, res ? res->ai_addr : (struct sockaddr *)&un,
+		      res ? res->ai_addrlen : sizeof(un)) == 0 &&
+		 (res || chmod(un.sun_path, 0600) == 0) &&
+		 listen(fd, 64) == 0;
+	if (!ok) {
+		fprintf(stderr, "ERROR: Could not listen on %s: %s\n", addr,
+			strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+	if (res)
+		freeaddrinfo(res);
+	return fd;
+}
+
+/* A connection to a worker whose magic and request type are still coming
+ * in */
+typedef struct {
+	int fd;
+	int64_t accepted;
+	size_t count;
+	unsigned char buf[2 * (4 + APE__REMOTE_MAX_HANDSHAKE)];
+} ApeWorkerConn;
+
+/* Bytes still missing from the handshake of c, 0 once it is complete and
+ * SIZE_MAX if it is invalid */
+size_t ape__worker_handshake_missing(const ApeWorkerConn *c)
+{
+	size_t end = 0;
+	for (int i = 0; i < 2; i++) {
+		if (c->count < end + 4)
+			return end + 4 - c->count;
+		const unsigned char *p = c->buf + end;
+		size_t n = (size_t)p[0] << 24 | (size_t)p[1] << 16 |
+			   (size_t)p[2] << 8 | p[3];
+		if (n > APE__REMOTE_MAX_HANDSHAKE)
+			return SIZE_MAX;
+		end += 4 + n;
+		if (c->count < end)
+			return end - c->count;
+	}
+	return 0;
+}
+
+/* Reads what has arrived of the handshake of c without blocking, and never
+ * past it. Returns the request type once it is complete, "" until then and
+ * NULL if it is invalid or the client went away */
+const char *ape__worker_handshake(ApeWorkerConn *c)
+{
+	for (;;) {
+		size_t missing = ape__worker_handshake_missing(c);
+		if (missing == SIZE_MAX)
+			return NULL;
+		if (missing == 0)
+			break;
+		ssize_t r = recv(c->fd, c->buf + c->count, missing, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return "";
+		if (r <= 0)
+			return NULL;
+		c->count += r;
+	}
+	size_t n = strlen(APE__REMOTE_MAGIC);
+	if (c->buf[3] != n || memcmp(c->buf + 4, APE__REMOTE_MAGIC, n) != 0)
+		return NULL;
+	const unsigned char *type = c->buf + 4 + n + 4;
+	size_t len = c->count - (4 + n + 4);
+	if (len == 4 && memcmp(type, "stat", 4) == 0)
+		return "stat";
+	if (len == 7 && memcmp(type, "compile", 7) == 0)
+		return "compile";
+	return NULL;
+}
+
+/* The main of apebuild-worker: accepts compiles from builds and runs up to
+ * -j of them at once, queueing the rest. Only the allowed compilers and
+ * flags run, but anyone who can connect to a TCP address can use them, so
+ * only listen on one on a trusted network. A Unix socket only accepts our
+ * own user */
+int ape_worker_run(int argc, char **argv)
+{
+	const char *addr = APE_WORKER_ADDR;
+	long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+	int slots = nproc > 0 ? (int)nproc : 1;
+	int verbose = 0;
+	ApeStrList compilers = { 0 };
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if (strncmp(arg, "--listen=", 9) == 0) {
+			addr = arg + 9;
+		} else if (strncmp(arg, "--compiler=", 11) == 0) {
+			ape_da_append(&compilers, (char *)arg + 11);
+		} else if (strcmp(arg, "-v") == 0 ||
+			   strcmp(arg, "--verbose") == 0) {
+			verbose = 1;
+		} else if (strncmp(arg, "-j", 2) == 0) {
+			const char *value = arg[2] || i + 1 >= argc ? arg + 2 :
+								      argv[++i];
+			char *end = NULL;
+			slots = strtol(value, &end, 10);
+			if (*value == '\0' || *end != '\0' || slots < 1) {
+				fprintf(stderr,
+					"ERROR: Invalid job count: %s\n",
+					value);
+				return 1;
+			}
+		} else {
+			fprintf(stderr,
+				"Usage: %s [--listen=HOST:PORT|PATH] [-j N] "
+				"[--compiler=CC]... [-v]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (compilers.count == 0)
+		ape_da_append(&compilers, APECC);
+	int lfd = ape__worker_listen(addr);
+	if (lfd < 0)
+		return 1;
+	fprintf(stderr, "INFO: Listening on %s with %d slots\n", addr, slots);
+	struct {
+		size_t capacity;
+		size_t count;
+		int *items;
+	} queue = { 0 };
+	struct {
+		size_t capacity;
+		size_t count;
+		ApeWorkerConn *items;
+	} conns = { 0 };
+	struct {
+		size_t capacity;
+		size_t count;
+		struct pollfd *items;
+	} pfds = { 0 };
+	int running = 0;
+	for (;;) {
+		int wstatus;
+		while (running > 0 && waitpid(-1, &wstatus, WNOHANG) > 0)
+			running--;
+		while (running < slots && queue.count > 0) {
+			int fd = queue.items[0];
+			memmove(queue.items, queue.items + 1,
+				--queue.count * sizeof(int));
+			pid_t pid = fork();
+			if (pid == 0) {
+				close(lfd);
+				for (size_t i = 0; i < queue.count; i++)
+					close(queue.items[i]);
+				for (size_t i = 0; i < conns.count; i++)
+					close(conns.items[i].fd);
+				ape__worker_compile(fd, compilers, verbose);
+				_exit(0);
+			}
+			close(fd);
+			if (pid > 0)
+				running++;
+		}
+		/* Handshakes are read here as they arrive, so a client that
+		 * stops sending only holds up itself */
+		pfds.count = 0;
+		ape_da_append(&pfds, ((struct pollfd){ lfd, POLLIN, 0 }));
+		for (size_t i = 0; i < conns.count; i++)
+			ape_da_append(&pfds, ((struct pollfd){ conns.items[i].fd,
+							       POLLIN, 0 }));
+		if (poll(pfds.items, pfds.count, 100) < 0 && errno != EINTR)
+			continue;
+		int64_t now = ape__now_ns();
+		for (size_t i = conns.count; i-- > 0;) {
+			ApeWorkerConn *c = &conns.items[i];
+			const char *type = "";
+			if (pfds.items[i + 1].revents)
+				type = ape__worker_handshake(c);
+			if (type && !*type &&
+			    now - c->accepted > APE__REMOTE_HANDSHAKE_TIMEOUT_NS)
+				type = NULL;
+			if (type && !*type)
+				continue;
+			if (type && strcmp(type, "stat") == 0) {
+				char s[64];
+				snprintf(s, sizeof(s), "%d %d", slots,
+					 running + (int)queue.count);
+				ape__remote_send_str(c->fd, s);
+			}
+			if (type && strcmp(type, "compile") == 0) {
+				/* The compile reads the rest of the request,
+				 * from a client that stops sending only for
+				 * so long */
+				struct timeval timeout = { .tv_sec = 10 };
+				fcntl(c->fd, F_SETFL, 0);
+				setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO,
+					   &timeout, sizeof(timeout));
+				ape_da_append(&queue, c->fd);
+			} else {
+				close(c->fd);
+			}
+			conns.items[i] = conns.items[--conns.count];
+		}
+		if (!(pfds.items[0].revents & POLLIN))
+			continue;
+		int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if (fd < 0)
+			continue;
+		if (conns.count >= APE__REMOTE_MAX_PENDING) {
+			close(fd);
+			continue;
+		}
+		ApeWorkerConn c = { .fd = fd, .accepted = now };
+		ape_da_append(&conns, c);
+	}
+}
+
+/* Print the full commands instead of a status line, set with --verbose */
+#ifdef APE_VERBOSE
+int ape__verbose = 1;
+#else
+int ape__verbose = 0;
+#endif
+
+/* On a terminal the status line is redrawn in place, and pending until
+ * something else is printed */
+struct {
+	int tty;
+	int pending;
+} ape__status;
+
+void ape__status_break(void)
+{
+	if (ape__status.pending) {
+		fputc('\n', stderr);
+		ape__status.pending = 0;
+	}
+}
+
+/* Prints the [n/total] status line of a job that is starting */
+void ape__status_line(size_t n, size_t total, const ApeJob *job)
+{
+	ApeStrBuilder sb = { 0 };
+	char count[64];
+	snprintf(count, sizeof(count), "[%zu/%zu] ", n, total);
+	ape_sb_append_str(&sb, count);
+	if (ape__verbose) {
+		if (job->cwd) {
+			ape_sb_append_str(&sb, "cd ");
+			ape_sb_append_str(&sb, job->cwd);
+			ape_sb_append_str(&sb, " && ");
+		}
+		ape_cmd_render(job->cmd, &sb);
+	} else if (job->description) {
+		ape_sb_append_str(&sb, job->description);
+	} else {
+		int compile = ape__job_compiles(job);
+		int link = job->kind == APE_JOB_LINK ||
+			   job->kind == APE_JOB_ARCHIVE;
+		ape_sb_append_str(&sb, compile ? "Compiling " :
+				       link    ? "Linking " :
+						 "Running ");
+		ape_sb_append_str(&sb, compile ? job->inputs[0] :
+				       link    ? job->output :
+						 job->cmd.items[0]);
+		if (job->kind == APE_JOB_BATCH) {
+			snprintf(count, sizeof(count), " and %zu more",
+				 job->inputs_count - 1);
+			ape_sb_append_str(&sb, count);
+		}
+	}
+	if (job->worker) {
+		ape_sb_append_str(&sb, " on ");
+		ape_sb_append_str(&sb,
+				  ape__remote_workers.items[job->worker - 1].addr);
+	}
+	struct winsize ws;
+	if (!ape__status.tty || ape__verbose) {
+		ape__status_break();
+		fprintf(stderr, "%.*s\n", (int)sb.count, sb.items);
+	} else {
+		/* A wrapped line can't be redrawn */
+		size_t len = sb.count;
+		if (ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 &&
+		    ws.ws_col > 0 && len >= ws.ws_col)
+			len = ws.ws_col - 1;
+		fprintf(stderr, "\r%.*s\x1b[K", (int)len, sb.items);
+		ape__status.pending = 1;
+	}
+	ape_da_free(sb);
+}
+
+/* Prints the output of a finished job in one piece */
+void ape__job_report(const ApeJob *job, const ApeStrBuilder *out, int failed)
+{
+	if (!failed && out->count == 0)
+		return;
+	ape__status_break();
+	if (failed) {
+		ApeStrBuilder sb = { 0 };
+		ape_cmd_render(job->cmd, &sb);
+		fprintf(stderr, "FAILED: %.*s\n", (int)sb.count, sb.items);
+		ape_da_free(sb);
+	}
+	fwrite(out->items, 1, out->count, stderr);
+	if (out->count > 0 && out->items[out->count - 1] != '\n')
+		fputc('\n', stderr);
+}
+
+/* Reads what a command wrote to its output pipe so far, a bounded amount so
+ * a command writing without pause can't hold up the others. Returns 0 once
+ * the pipe is closed */
+int ape__job_read_output(int fd, ApeStrBuilder *out)
+{
+	char buf[16384];
+	for (int i = 0; i < 16; i++) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n > 0) {
+			ape_da_append_many(out, buf, (size_t)n);
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		return n != 0;
+	}
+	return 1;
+}
+
+/* Sleeps until a command exited or wrote output, or while starved a token
+ * may be available. fds must have room for nrunning + 2 entries */
+void ape__sched_wait(struct pollfd *fds, int *outfds, ApeStrBuilder *outs,
+		     size_t nrunning, int starved)
+{
+	size_t n = 0;
+	fds[n++] = (struct pollfd){ .fd = ape__sigchld_pipe[0],
+				    .events = POLLIN };
+	fds[n++] = (struct pollfd){ .fd = starved ? ape__jobserver.rfd : -1,
+				    .events = POLLIN };
+	for (size_t i = 0; i < nrunning; i++)
+		fds[n++] = (struct pollfd){ .fd = outfds[i], .events = POLLIN };
+	if (poll(fds, n, -1) <= 0)
+		return;
+	if (fds[0].revents & POLLIN) {
+		char buf[64];
+		while (read(ape__sigchld_pipe[0], buf, sizeof(buf)) > 0)
+			;
+	}
+	for (size_t i = 0; i < nrunning; i++) {
+		if (!fds[i + 2].revents)
+			continue;
+		if (!ape__job_read_output(outfds[i], &outs[i])) {
+			close(outfds[i]);
+			outfds[i] = -1;
+		}
+	}
+}
+
+/* Runs a graph of jobs with at most `njobs` of them in flight at once,
+ * starting each job as soon as the jobs it depends on are done, those on the
+ * longest path to the end of the build first. With a jobserver, every job
+ * but the first also needs one of its tokens. A job is also held back while
+ * the expected memory use of it and the running jobs exceeds the budget.
+ * The output of each job goes to a pipe and is printed in one piece when it
+ * is done, with a status line per job instead of its command.
+ * After the first failure no new jobs are started, but the ones already
+ * running are still waited for */
+int ape_jobs_run_parallel(ApeJobList jobs, size_t njobs)
+{
+	if (njobs < 1)
+		njobs = 1;
+	ApeSched s = { .jobs = jobs };
+	s.pending = calloc(jobs.count + 1, sizeof(size_t));
+	s.dependents_start = calloc(jobs.count + 2, sizeof(size_t));
+	s.ready = malloc((jobs.count + 1) * sizeof(size_t));
+	s.priority = calloc(jobs.count + 1, sizeof(int64_t));
+	s.memory = calloc(jobs.count + 1, sizeof(int64_t));
+	int ok = 1;
+	for (size_t i = 0; i < jobs.count; i++) {
+		for (size_t j = 0; j < jobs.items[i].deps.count; j++) {
+			size_t dep = jobs.items[i].deps.items[j];
+			if (dep >= jobs.count) {
+				fprintf(stderr,
+					"ERROR: Job %zu depends on unknown job %zu\n",
+					i, dep);
+				ok = 0;
+				continue;
+			}
+			s.dependents_start[dep + 2]++;
+		}
+		s.pending[i] = jobs.items[i].deps.count;
+	}
+	for (size_t i = 2; i < jobs.count + 2; i++)
+		s.dependents_start[i] += s.dependents_start[i - 1];
+	s.dependents = malloc((s.dependents_start[jobs.count + 1] + 1) *
+			      sizeof(size_t));
+	for (size_t i = 0; ok && i < jobs.count; i++)
+		for (size_t j = 0; j < jobs.items[i].deps.count; j++)
+			s.dependents[s.dependents_start
+					     [jobs.items[i].deps.items[j] + 1]++] =
+				i;
+	if (ok)
+		ape__sched_prioritize(&s);
+	int64_t mem_budget = ape__mem_budget;
+	if (mem_budget < 0)
+		mem_budget = ape__mem_available() / 10 * 9;
+	int64_t mem_reserved = 0;
+	if (mem_budget > 0)
+		ape__sched_estimate_memory(&s);
+	for (size_t i = 0; i < jobs.count; i++)
+		if (s.pending[i] == 0)
+			ape__sched_push(&s, i);
+
+	pid_t *running = malloc(njobs * sizeof(pid_t));
+	size_t *running_job = malloc(njobs * sizeof(size_t));
+	/* Job slots are numbered from 1 in the trace, 0 is apebuild */
+	size_t *running_slot = malloc(njobs * sizeof(size_t));
+	char *slot_busy = calloc(njobs + 1, 1);
+	int *running_fd = malloc(njobs * sizeof(int));
+	ApeStrBuilder *running_out = calloc(njobs, sizeof(ApeStrBuilder));
+	struct pollfd *pfds = malloc((njobs + 2) * sizeof(struct pollfd));
+	size_t nrunning = 0;
+	size_t total = jobs.count, nstarted = 0;
+	ape__status.tty = isatty(STDERR_FILENO);
+	ape__children = running;
+	ape__nchildren = 0;
+	struct sigaction sa = { .sa_handler = ape__forward_signal,
+				.sa_flags = SA_RESTART };
+	sigemptyset(&sa.sa_mask);
+	struct sigaction old_int, old_term, old_chld;
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+	/* Exiting commands wake up the poll for their output */
+	if (pipe(ape__sigchld_pipe) != 0) {
+		fprintf(stderr, "ERROR: Could not create pipe: %s\n",
+			strerror(errno));
+		ok = 0;
+		ape__sigchld_pipe[0] = ape__sigchld_pipe[1] = -1;
+	}
+	for (int i = 0; ok && i < 2; i++) {
+		fcntl(ape__sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+		fcntl(ape__sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+	struct sigaction chld = { .sa_handler = ape__sigchld,
+				  .sa_flags = SA_RESTART | SA_NOCLDSTOP };
+	sigemptyset(&chld.sa_mask);
+	sigaction(SIGCHLD, &chld, &old_chld);
+	int jobserver = ape__jobserver.rfd >= 0;
+	while (nrunning > 0 || (ok && s.nready > 0)) {
+		if (ape__interrupted)
+			ok = 0;
+		int starved = 0;
+		while (ok && nrunning < njobs && s.nready > 0) {
+			size_t next = ape__sched_pop(&s);
+			ApeJob *job = &jobs.items[next];
+			if (job->batched) {
+				/* Its batch compiled it already */
+				total--;
+				if (!ape__batch_collect(job) ||
+				    !ape_job_finish(job)) {
+					ok = 0;
+					continue;
+				}
+				ape__sched_release(&s, next);
+				continue;
+			}
+			if (job->lazy && !ape__job_needs_run(job)) {
+				job->changed = 0;
+				total--;
+				ape__sched_release(&s, next);
+				continue;
+			}
+			/* Wait for running jobs to free memory, but never let
+			 * smaller jobs overtake this one */
+			if (mem_budget > 0 && nrunning > 0 &&
+			    mem_reserved + s.memory[next] > mem_budget) {
+				if (!ape__mem_held)
+					fprintf(stderr,
+						"INFO: Running fewer jobs to "
+						"stay within the memory budget "
+						"of %lld MiB\n",
+						(long long)(mem_budget >> 20));
+				ape__mem_held = 1;
+				ape__sched_push(&s, next);
+				break;
+			}
+			if (jobserver && nrunning > 0 &&
+			    !ape__jobserver_acquire()) {
+				ape__sched_push(&s, next);
+				starved = 1;
+				break;
+			}
+			/* Outputs may be hardlinks to cached objects, and
+			 * archivers update them in place, so every command
+			 * starts from a new file */
+			if (job->output)
+				unlink(job->output);
+			int out[2];
+			if (pipe(out) != 0) {
+				fprintf(stderr,
+					"ERROR: Could not create pipe: %s\n",
+					strerror(errno));
+				ok = 0;
+				break;
+			}
+			fcntl(out[0], F_SETFL, O_NONBLOCK);
+			fcntl(out[0], F_SETFD, FD_CLOEXEC);
+			fcntl(out[1], F_SETFD, FD_CLOEXEC);
+			ApeCmd remote = { 0 };
+			if (ape__remote_pick(job))
+				remote = ape__remote_cmd(job);
+			ape__status_line(++nstarted, total, job);
+			job->started = ape__now_ns();
+			ApeProc p = ape__spawn(job->worker ? remote : job->cmd,
+					       job->cwd, job->env, out[1], 0);
+			ape_cmd_free(remote);
+			close(out[1]);
+			if (p == APE_INVALID_PROC) {
+				close(out[0]);
+				ok = 0;
+				break;
+			}
+			ape__jobs_started++;
+			size_t slot = 1;
+			while (slot_busy[slot])
+				slot++;
+			slot_busy[slot] = 1;
+			running[nrunning] = p;
+			running_job[nrunning] = next;
+			running_slot[nrunning] = slot;
+			running_fd[nrunning] = out[0];
+			running_out[nrunning].count = 0;
+			mem_reserved += s.memory[next];
+			ape__nchildren = ++nrunning;
+		}
+		if (nrunning == 0)
+			break;
+		int wstatus = 0;
+		struct rusage ru;
+		pid_t pid = wait4(-1, &wstatus, WNOHANG, &ru);
+		if (pid == 0) {
+			ape__sched_wait(pfds, running_fd, running_out, nrunning,
+					starved);
+			continue;
+		}
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr,
+				"ERROR: Could not wait on commands: %s\n",
+				strerror(errno));
+			ok = 0;
+			break;
+		}
+		size_t slot = 0;
+		while (slot < nrunning && running[slot] != pid)
+			slot++;
+		if (slot == nrunning)
+			continue;
+		if (!WIFEXITED(wstatus) && !WIFSIGNALED(wstatus))
+			continue;
+		size_t finished = running_job[slot];
+		ApeJob *job = &jobs.items[finished];
+		/* Whatever is left in the pipe, unless a process the command
+		 * started still holds it open */
+		if (running_fd[slot] >= 0) {
+			ape__job_read_output(running_fd[slot],
+					     &running_out[slot]);
+			close(running_fd[slot]);
+		}
+		/* The errors of a failed batch are reported by the compiles
+		 * that run on their own after it */
+		int failed = !WIFEXITED(wstatus) || WEXITSTATUS(wstatus);
+		if (!failed || job->kind != APE_JOB_BATCH)
+			ape__job_report(job, &running_out[slot],
+					failed && !ape__interrupted);
+		int status = failed && job->kind == APE_JOB_BATCH ? 0 :
+						    ape__proc_status(wstatus);
+		job->duration = ape__now_ns() - job->started;
+		job->max_rss = (int64_t)ru.ru_maxrss * 1024;
+		ape__remote_done(job);
+		mem_reserved -= s.memory[finished];
+		if (ape__trace_path) {
+			int compile = ape__job_compiles(job);
+			const char *category = "link";
+			if (compile)
+				category = "compile";
+			else if (job->kind == APE_JOB_RUN)
+				category = "run";
+			ape__trace_span(category,
+					compile		 ? job->inputs[0] :
+					job->description ? job->description :
+					job->output	 ? job->output :
+							   job->cmd.items[0],
+					job->started, running_slot[slot],
+					job->output, &ru);
+		}
+		slot_busy[running_slot[slot]] = 0;
+		/* The signal handler may see the moved pid twice, but never
+		 * misses a running one */
+		running[slot] = running[nrunning - 1];
+		running_job[slot] = running_job[nrunning - 1];
+		running_slot[slot] = running_slot[nrunning - 1];
+		running_fd[slot] = running_fd[nrunning - 1];
+		ApeStrBuilder done = running_out[slot];
+		running_out[slot] = running_out[nrunning - 1];
+		running_out[nrunning - 1] = done;
+		nrunning--;
+		ape__nchildren = nrunning;
+		if (jobserver && ape__jobserver.tokens.count > 0 &&
+		    ape__jobserver.tokens.count >= nrunning)
+			ape__jobserver_release();
+		if (!status && ape__interrupted && jobs.items[finished].output) {
+			/* Don't leave a half written output behind */
+			unlink(jobs.items[finished].output);
+			ape_stat_cache_invalidate(jobs.items[finished].output);
+		}
+		if (job->kind == APE_JOB_BATCH && !ape__interrupted) {
+			/* If it failed, its compiles run on their own to find
+			 * the ones that fail */
+			for (size_t i = s.dependents_start[finished];
+			     i < s.dependents_start[finished + 1]; i++) {
+				ApeJob *dep = &jobs.items[s.dependents[i]];
+				if (!dep->batch_obj)
+					continue;
+				dep->batched = status;
+				dep->duration =
+					job->duration / job->inputs_count;
+				dep->max_rss = job->max_rss;
+			}
+			ape__sched_release(&s, finished);
+			continue;
+		}
+		if (!status || !ape_job_finish(&jobs.items[finished])) {
+			ok = 0;
+			continue;
+		}
+		ape__sched_release(&s, finished);
+	}
+	ape__status_break();
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	sigaction(SIGCHLD, &old_chld, NULL);
+	if (ape__sigchld_pipe[0] >= 0) {
+		close(ape__sigchld_pipe[0]);
+		close(ape__sigchld_pipe[1]);
+		ape__sigchld_pipe[0] = ape__sigchld_pipe[1] = -1;
+	}
+	ape__nchildren = 0;
+	ape__children = NULL;
+	if (ape__interrupted) {
+		fprintf(stderr, "ERROR: Interrupted by %s\n",
+			strsignal(ape__interrupted));
+		ok = 0;
+	}
+	if (ok && s.done < jobs.count) {
+		fprintf(stderr, "ERROR: Dependency cycle between jobs\n");
+		ok = 0;
+	}
+	free(running);
+	free(running_job);
+	free(running_slot);
+	free(slot_busy);
+	free(running_fd);
+	for (size_t i = 0; i < njobs; i++)
+		ape_da_free(running_out[i]);
+	free(running_out);
+	free(pfds);
+	free(s.pending);
+	free(s.dependents);
+	free(s.dependents_start);
+	free(s.ready);
+	free(s.priority);
+	free(s.memory);
+	return ok;
+}
+
+int ape_cmds_run_parallel(ApeCmdList cmds, size_t jobs)
+{
+	ApeJobList jl = { 0 };
+	for (size_t i = 0; i < cmds.count; i++)
+		ape_da_append(&jl, ((ApeJob){ .cmd = cmds.items[i] }));
+	int r = ape_jobs_run_parallel(jl, jobs);
+	ape_da_free(jl);
+	return r;
+}
+
+int ape_rename(const char *oldname, const char *newname)
+{
+	if (rename(oldname, newname) == 0) {
+		fprintf(stderr, "INFO: %s > %s\n", oldname, newname);
+		return 1;
+	}
+	fprintf(stderr, "ERROR: Couldn't rename file %s: %s\n", oldname,
+		strerror(errno));
+	return 0;
+}
+
+typedef struct {
+	char *path;
+	/* Object and depfile names in the variant they were made for */
+	char *objfile;
+	char *depfile;
+	const char *variant;
+	int valid;
+	int err;
+	uint32_t log_id;
+	/* In watch mode: 1 for inputs whose changes trigger a rebuild, 2 for
+	 * outputs of the build */
+	int watch;
+	struct stat st;
+} ApeStatEntry;
+
+/* Open addressing hash table of stat results, so that inputs shared by many
+ * outputs (mostly headers) are only stat'ed once per run */
+struct {
+	size_t capacity;
+	size_t count;
+	ApeStatEntry *items;
+} ape__stat_cache;
+
+uint64_t ape__hash_str(const char *s)
+{
+	uint64_t h = 14695981039346656037ULL;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+ApeStatEntry *ape__stat_cache_slot(const char *path)
+{
+	if (2 * (ape__stat_cache.count + 1) > ape__stat_cache.capacity) {
+		size_t old_capacity = ape__stat_cache.capacity;
+		ApeStatEntry *old_items = ape__stat_cache.items;
+		ape__stat_cache.capacity =
+			old_capacity == 0 ? APE_DA_INIT_CAP : old_capacity * 2;
+		ape__stat_cache.items = calloc(ape__stat_cache.capacity,
+					       sizeof(ApeStatEntry));
+		ape__stat_cache.count = 0;
+		for (size_t i = 0; i < old_capacity; i++) {
+			if (!old_items[i].path)
+				continue;
+			*ape__stat_cache_slot(old_items[i].path) = old_items[i];
+			ape__stat_cache.count++;
+		}
+		free(old_items);
+	}
+	size_t mask = ape__stat_cache.capacity - 1;
+	size_t i = ape__hash_str(path) & mask;
+	while (ape__stat_cache.items[i].path &&
+	       strcmp(ape__stat_cache.items[i].path, path) != 0)
+		i = (i + 1) & mask;
+	return &ape__stat_cache.items[i];
+}
+
+ApeStatEntry *ape__path_entry(const char *path)
+{
+	ApeStatEntry *e = ape__stat_cache_slot(path);
+	if (!e->path) {
+		e->path = ape_arena_strndup(&ape__arena, path, strlen(path));
+		ape__stat_cache.count++;
+	}
+	return e;
+}
+
+/* Returns the single copy of path kept for the whole session, so equal paths
+ * can be shared between jobs instead of being duplicated */
+char *ape_intern(const char *path)
+{
+	return ape__path_entry(path)->path;
+}
+
+char *ape__path_with_ext(const char *path, const char *ext)
+{
+	size_t n = strlen(path), m = strlen(ext);
+	char *s = ape_arena_alloc(&ape__arena, n + m + 1);
+	memcpy(s, path, n);
+	memcpy(s + n, ext, m + 1);
+	return s;
+}
+
+/* Variant being built, NULL if there are none */
+const ApeVariant *ape__current_variant;
+
+/* Appends the directory the outputs of the current variant go to, objects
+ * go to its obj/ subdirectory */
+void ape__variant_dir(ApeStrBuilder *sb)
+{
+	ape_sb_append_str(sb, APE_OUTPUT_DIR);
+	if (ape__current_variant) {
+		ape_sb_append_str(sb, ape__current_variant->name);
+		ape_da_append(sb, '/');
+	}
+}
+
+/* The outputs of a source mirror its path in the variant's obj/ directory.
+ * Sources generated in APE_OUTPUT_DIR are taken relative to it, a leading
+ * '/' is dropped and ".." becomes "__" so that nothing ends up outside */
+char *ape__output_path(const char *src, const char *ext)
+{
+	ApeStrBuilder sb = { 0 };
+	ape__variant_dir(&sb);
+	ape_sb_append_str(&sb, "obj/");
+	size_t outlen = strlen(APE_OUTPUT_DIR);
+	if (outlen > 0 && strncmp(src, APE_OUTPUT_DIR, outlen) == 0)
+		src += outlen;
+	while (*src) {
+		size_t len = strcspn(src, "/");
+		if (len == 2 && src[0] == '.' && src[1] == '.')
+			ape_sb_append_str(&sb, "__");
+		else if (len > 0 && !(len == 1 && src[0] == '.'))
+			ape_da_append_many(&sb, src, len);
+		src += len;
+		if (*src == '/') {
+			if (sb.count > 0 && sb.items[sb.count - 1] != '/')
+				ape_da_append(&sb, '/');
+			src++;
+		}
+	}
+	ape_sb_append_str(&sb, ext);
+	ape_da_append(&sb, 0);
+	char *path = ape_intern(sb.items);
+	ape_da_free(sb);
+	return path;
+}
+
+/* Object and depfile names are made once per source and variant and must
+ * not be freed */
+char *ape_objfile_name(char *srcfilename)
+{
+	ApeStatEntry *e = ape__path_entry(srcfilename);
+	const char *variant =
+		ape__current_variant ? ape__current_variant->name : NULL;
+	if (!e->objfile || e->variant != variant) {
+		char *path = e->path;
+		char *objfile = ape__output_path(path, APE_OBJ_EXTENSION);
+		char *depfile = ape__output_path(path, APE_DEP_EXTENSION);
+		/* Interning may have moved the entry */
+		e = ape__path_entry(path);
+		e->objfile = objfile;
+		e->depfile = depfile;
+		e->variant = variant;
+	}
+	return e->objfile;
+}
+
+char *ape_depfile_name(char *srcfilename)
+{
+	ape_objfile_name(srcfilename);
+	return ape__path_entry(srcfilename)->depfile;
+}
+
+/* Creates the directory path is in, unless it is known to exist */
+int ape__mkdir_for(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	if (!slash || slash == path)
+		return 1;
+	ApeStrBuilder dir = { 0 };
+	ape_da_append_many(&dir, path, (size_t)(slash - path));
+	ape_da_append(&dir, 0);
+	const struct stat *st = ape_stat_cached(dir.items);
+	int ok = st && S_ISDIR(st->st_mode);
+	if (!ok) {
+		ok = ape_mkdir_p(dir.items);
+		ape_stat_cache_invalidate(dir.items);
+	}
+	ape_da_free(dir);
+	return ok;
+}
+
+/* Returns NULL and sets errno if the file can't be stat'ed */
+const struct stat *ape_stat_cached(const char *path)
+{
+	ApeStatEntry *e = ape__path_entry(path);
+	if (!e->valid) {
+		e->err = stat(path, &e->st) != 0 ? errno : 0;
+		e->valid = 1;
+	}
+	if (e->err) {
+		errno = e->err;
+		return NULL;
+	}
+	return &e->st;
+}
+
+/* Must be called for files that change during the run, e.g. outputs */
+void ape_stat_cache_invalidate(const char *path)
+{
+	if (ape__stat_cache.capacity == 0)
+		return;
+	ApeStatEntry *e = ape__stat_cache_slot(path);
+	if (e->path)
+		e->valid = 0;
+}
+
+int ape__needs_rebuild(const char *outfile, char **infiles, size_t len,
+		       int quiet)
+{
+	struct stat outs;
+	if (stat(outfile, &outs) != 0) {
+		return 1;
+	}
+	for (size_t i = 0; i < len; i++) {
+		const struct stat *ins = ape_stat_cached(infiles[i]);
+		if (!ins) {
+			if (!quiet)
+				fprintf(stderr,
+					"ERROR: Failed to get stat (of file %s): %s\n",
+					infiles[i], strerror(errno));
+			return 1;
+		}
+		if (ins->st_mtime > outs.st_mtime) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int ape_needs_rebuild(const char *outfile, char **infiles, size_t len)
+{
+	return ape__needs_rebuild(outfile, infiles, len, 0);
+}
+
+int ape_needs_rebuild1(const char *outfile, const char *infile)
+{
+	return ape_needs_rebuild(outfile, (char **)&infile, 1);
+}
+
+/* Parses the prerequisites of the first rule in a make style depfile, as
+ * written by -MMD. Returns 0 if the file could not be read */
+int ape_parse_depfile(const char *depfile, ApeStrList *deps)
+{
+	FILE *f = fopen(depfile, "rb");
+	if (!f)
+		return 0;
+	ApeStrBuilder content = { 0 };
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		ape_da_append_many(&content, buf, n);
+	fclose(f);
+	ape_da_append(&content, 0);
+
+	/* Skip the target, the colon is the first one followed by whitespace */
+	char *p = content.items;
+	while (*p && !(*p == ':' && (p[1] == ' ' || p[1] == '\t' ||
+				     p[1] == '\r' || p[1] == '\n' ||
+				     p[1] == '\0')))
+		p++;
+	if (*p)
+		p++;
+	ApeStrBuilder path = { 0 };
+	for (;;) {
+		char c = *p;
+		if (c == '\\' && p[1] == '\n') {
+			p += 2;
+			c = ' ';
+		} else if (c == '\\' && p[1] == '\r' && p[2] == '\n') {
+			p += 3;
+			c = ' ';
+		} else if (c == '\\' && (p[1] == ' ' || p[1] == '#')) {
+			ape_da_append(&path, p[1]);
+			p += 2;
+			continue;
+		} else if (c == '$' && p[1] == '$') {
+			ape_da_append(&path, '$');
+			p += 2;
+			continue;
+		} else if (c != '\0') {
+			p++;
+		}
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\n' ||
+		    c == '\0') {
+			if (path.count > 0) {
+				ape_da_append(&path, 0);
+				ape_da_append(deps, ape_intern(path.items));
+				path.count = 0;
+			}
+			if (c == '\n' || c == '\0')
+				break;
+			continue;
+		}
+		ape_da_append(&path, c);
+	}
+	ape_da_free(path);
+	ape_da_free(content);
+	return 1;
+}
+
+/* Checks outfile against every file listed in its depfile, falling back to
+ * the source file alone when there is no depfile yet */
+int ape_needs_rebuild_depfile(const char *outfile, const char *srcfile,
+			      const char *depfile)
+{
+	ApeStrList deps = { 0 };
+	if (!ape_parse_depfile(depfile, &deps) || deps.count == 0) {
+		ape_da_free(deps);
+		return ape_needs_rebuild1(outfile, srcfile);
+	}
+	/* A header that has disappeared since the last build just means that
+	 * the source has to be rebuilt, it is not an error */
+	int r = ape_needs_rebuild1(outfile, srcfile) ||
+		ape__needs_rebuild(outfile, deps.items, deps.count, 1);
+	ape_da_free(deps);
+	return r;
+}
+
+int ape_mkdir_p(const char *path)
+{
+	ApeStrBuilder sb = { 0 };
+	ape_sb_append_str(&sb, path);
+	ape_da_append(&sb, 0);
+	for (char *p = sb.items + 1;; p++) {
+		if (*p != '/' && *p != '\0')
+			continue;
+		char c = *p;
+		*p = '\0';
+		if (mkdir(sb.items, 0755) != 0 && errno != EEXIST) {
+			fprintf(stderr,
+				"ERROR: Could not create directory %s: %s\n",
+				sb.items, strerror(errno));
+			ape_da_free(sb);
+			return 0;
+		}
+		*p = c;
+		if (c == '\0')
+			break;
+	}
+	ape_da_free(sb);
+	return 1;
+}
+
+#define APE__XXH_P1 11400714785074694791ULL
+#define APE__XXH_P2 14029467366897019727ULL
+#define APE__XXH_P3 1609587929392839161ULL
+#define APE__XXH_P4 9650029242287828579ULL
+#define APE__XXH_P5 2870177450012600261ULL
+
+uint64_t ape__rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+uint64_t ape__xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * APE__XXH_P2;
+	return ape__rotl64(acc, 31) * APE__XXH_P1;
+}
+
+uint64_t ape__xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= ape__xxh_round(0, val);
+	return acc * APE__XXH_P1 + APE__XXH_P4;
+}
+
+/* XXH64, used to hash file contents */
+uint64_t ape_hash64(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+	uint64_t h, k;
+	uint32_t k32;
+	if (len >= 32) {
+		uint64_t v[4] = { seed + APE__XXH_P1 + APE__XXH_P2,
+				  seed + APE__XXH_P2, seed,
+				  seed - APE__XXH_P1 };
+		do {
+			for (int i = 0; i < 4; i++, p += 8) {
+				memcpy(&k, p, 8);
+				v[i] = ape__xxh_round(v[i], k);
+			}
+		} while (p + 32 <= end);
+		h = ape__rotl64(v[0], 1) + ape__rotl64(v[1], 7) +
+		    ape__rotl64(v[2], 12) + ape__rotl64(v[3], 18);
+		for (int i = 0; i < 4; i++)
+			h = ape__xxh_merge(h, v[i]);
+	} else {
+		h = seed + APE__XXH_P5;
+	}
+	h += len;
+	for (; p + 8 <= end; p += 8) {
+		memcpy(&k, p, 8);
+		h ^= ape__xxh_round(0, k);
+		h = ape__rotl64(h, 27) * APE__XXH_P1 + APE__XXH_P4;
+	}
+	if (p + 4 <= end) {
+		memcpy(&k32, p, 4);
+		h ^= k32 * APE__XXH_P1;
+		h = ape__rotl64(h, 23) * APE__XXH_P2 + APE__XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * APE__XXH_P5;
+		h = ape__rotl64(h, 11) * APE__XXH_P1;
+	}
+	h ^= h >> 33;
+	h *= APE__XXH_P2;
+	h ^= h >> 29;
+	h *= APE__XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+int ape__hash_file(const char *path, size_t size, uint64_t *hash)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	if (size == 0) {
+		close(fd);
+		*hash = ape_hash64(NULL, 0, 0);
+		return 1;
+	}
+	void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 0;
+	*hash = ape_hash64(data, size, 0);
+	munmap(data, size);
+	return 1;
+}
+
+uint64_t ape_cmd_signature(ApeCmd cmd)
+{
+	ApeStrBuilder sb = { 0 };
+	ape_cmd_render(cmd, &sb);
+	ape_da_append(&sb, '\0');
+	uint64_t h = ape__hash_str(sb.items);
+	ape_da_free(sb);
+	return h;
+}
+
+/*
+ * The build log is an append-only file of 8 byte aligned records. Path
+ * records intern a file name, their ids are implicit (1 for the first path
+ * record and so on). Entry records store, for one output, the signature of
+ * the command that produced it and the mtimes of every input it was built
+ * from, and how long the command took and how much memory it needed. Later
+ * entries for the same output
+ * replace earlier ones, the file is
+ * compacted once it is mostly made up of such dead entries.
+ *
+ * In content hash mode entries also carry the hash of the output and of each
+ * input, and hash records remember the hash of a file together with the stat
+ * data it was computed for, so that files are only read again after they
+ * change.
+ */
+#define APE__LOG_MAGIC "APELOG"
+#define APE__LOG_VERSION 4
+#define APE__LOG_COMPACT_MIN 1024
+
+enum {
+	APE__LOG_PATH = 1,
+	APE__LOG_ENTRY = 2,
+	APE__LOG_HASH = 3,
+};
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+} ApeLogHeader;
+
+typedef struct {
+	uint32_t size;
+	uint32_t type;
+} ApeLogRecord;
+
+typedef struct {
+	uint32_t path;
+	uint32_t reserved;
+	int64_t mtime;
+	uint64_t hash;
+} ApeLogDep;
+
+typedef struct {
+	uint32_t output;
+	uint32_t count;
+	uint64_t signature;
+	int64_t mtime;
+	uint64_t hash;
+	int64_t duration;
+	int64_t max_rss;
+	ApeLogDep deps[];
+} ApeLogEntry;
+
+typedef struct {
+	uint32_t path;
+	uint32_t reserved;
+	int64_t mtime;
+	uint64_t size;
+	uint64_t ino;
+	uint64_t hash;
+} ApeLogHash;
+
+struct {
+	int fd;
+	char *map;
+	size_t map_size;
+	size_t records;
+	struct {
+		size_t capacity;
+		size_t count;
+		const char **items;
+	} paths;
+	struct {
+		size_t capacity;
+		size_t count;
+		const ApeLogEntry **items;
+	} entries;
+	struct {
+		size_t capacity;
+		size_t count;
+		const ApeLogHash **items;
+	} hashes;
+} ape__log = { .fd = -1 };
+
+/* Compare inputs by content instead of by mtime, set with --content-hash */
+#ifdef APE_CONTENT_HASH
+int ape__content_hash = 1;
+#else
+int ape__content_hash = 0;
+#endif
+
+int ape__log_write(const void *data, size_t size)
+{
+	const char *p = data;
+	while (size > 0) {
+		ssize_t n = write(ape__log.fd, p, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr,
+				"ERROR: Could not write build log: %s\n",
+				strerror(errno));
+			return 0;
+		}
+		p += n;
+		size -= n;
+	}
+	return 1;
+}
+
+void ape__log_append_record(ApeStrBuilder *buf, uint32_t type,
+			    const void *payload, size_t size)
+{
+	ApeLogRecord rec = { .size = (size + 7) & ~(size_t)7, .type = type };
+	ape_da_append_many(buf, (char *)&rec, sizeof(rec));
+	ape_da_append_many(buf, (const char *)payload, size);
+	for (size_t i = size; i < rec.size; i++)
+		ape_da_append(buf, 0);
+}
+
+/* Returns the id of path in the log, adding it if it isn't there yet */
+uint32_t ape__log_path_id(const char *path)
+{
+	ApeStatEntry *e = ape__path_entry(path);
+	if (e->log_id)
+		return e->log_id;
+	ApeStrBuilder buf = { 0 };
+	ape__log_append_record(&buf, APE__LOG_PATH, path, strlen(path) + 1);
+	int ok = ape__log_write(buf.items, buf.count);
+	ape_da_free(buf);
+	if (!ok)
+		return 0;
+	ape_da_append(&ape__log.paths, e->path);
+	ape_da_append(&ape__log.entries, NULL);
+	ape_da_append(&ape__log.hashes, NULL);
+	e->log_id = ape__log.paths.count;
+	return e->log_id;
+}
+
+/* Returns the content hash of a file, only reading it if its stat data
+ * differs from the last time it was hashed */
+int ape__log_file_hash(const char *path, struct stat st, uint64_t *hash)
+{
+	uint32_t id = ape__log_path_id(path);
+	if (!id)
+		return 0;
+	const ApeLogHash *cached = ape__log.hashes.items[id - 1];
+	if (cached && cached->mtime == ape__mtime_ns(&st) &&
+	    cached->size == (uint64_t)st.st_size &&
+	    cached->ino == (uint64_t)st.st_ino) {
+		*hash = cached->hash;
+		return 1;
+	}
+	if (!ape__hash_file(path, st.st_size, hash))
+		return 0;
+	ApeLogHash *rec = calloc(1, sizeof(ApeLogHash));
+	rec->path = id;
+	rec->mtime = ape__mtime_ns(&st);
+	rec->size = st.st_size;
+	rec->ino = st.st_ino;
+	rec->hash = *hash;
+	ApeStrBuilder buf = { 0 };
+	ape__log_append_record(&buf, APE__LOG_HASH, rec, sizeof(*rec));
+	int ok = ape__log_write(buf.items, buf.count);
+	ape_da_free(buf);
+	if (!ok) {
+		free(rec);
+		return 0;
+	}
+	ape__log.hashes.items[id - 1] = rec;
+	return 1;
+}
+
+/* Whether a file recorded with the given mtime and hash is unchanged */
+int ape__log_file_unchanged(const char *path, int64_t mtime, uint64_t hash)
+{
+	const struct stat *cached = ape_stat_cached(path);
+	if (!cached)
+		return 0;
+	if (ape__mtime_ns(cached) == mtime)
+		return 1;
+	if (hash == 0)
+		return 0;
+	struct stat st = *cached;
+	uint64_t current;
+	return ape__log_file_hash(path, st, &current) && current == hash;
+}
+
+void ape__log_reset(void)
+{
+	if (ape__log.map)
+		munmap(ape__log.map, ape__log.map_size);
+	if (ape__log.fd >= 0)
+		close(ape__log.fd);
+	ape_da_free(ape__log.paths);
+	ape_da_free(ape__log.entries);
+	ape_da_free(ape__log.hashes);
+	memset(&ape__log, 0, sizeof(ape__log));
+	ape__log.fd = -1;
+	for (size_t i = 0; i < ape__stat_cache.capacity; i++)
+		ape__stat_cache.items[i].log_id = 0;
+}
+
+/* Rewrites the log with only the latest entry of every output */
+int ape__log_compact(const char *path)
+{
+	ApeStrBuilder buf = { 0 };
+	ApeLogHeader header = { .magic = APE__LOG_MAGIC,
+				.version = APE__LOG_VERSION };
+	ape_da_append_many(&buf, (char *)&header, sizeof(header));
+	uint32_t *ids = calloc(ape__log.paths.count + 1, sizeof(uint32_t));
+	uint32_t next_id = 1;
+	for (size_t i = 0; i < ape__log.paths.count; i++) {
+		const ApeLogEntry *entry = ape__log.entries.items[i];
+		const ApeLogHash *hash = ape__log.hashes.items[i];
+		size_t size = 0;
+		ApeLogEntry *copy = NULL;
+		ApeLogHash hash_copy;
+		uint32_t *remap[2] = { 0 };
+		if (entry) {
+			size = sizeof(ApeLogEntry) +
+			       entry->count * sizeof(ApeLogDep);
+			copy = malloc(size);
+			memcpy(copy, entry, size);
+			remap[0] = &copy->output;
+		}
+		if (hash) {
+			hash_copy = *hash;
+			remap[1] = &hash_copy.path;
+		}
+		for (uint32_t j = 0; copy && j < copy->count; j++) {
+			uint32_t *id = &copy->deps[j].path;
+			if (!ids[*id]) {
+				const char *p = ape__log.paths.items[*id - 1];
+				ape__log_append_record(&buf, APE__LOG_PATH, p,
+						       strlen(p) + 1);
+				ids[*id] = next_id++;
+			}
+			*id = ids[*id];
+		}
+		for (int j = 0; j < 2; j++) {
+			if (!remap[j])
+				continue;
+			if (!ids[i + 1]) {
+				const char *p = ape__log.paths.items[i];
+				ape__log_append_record(&buf, APE__LOG_PATH, p,
+						       strlen(p) + 1);
+				ids[i + 1] = next_id++;
+			}
+			*remap[j] = ids[i + 1];
+		}
+		if (copy)
+			ape__log_append_record(&buf, APE__LOG_ENTRY, copy,
+					       size);
+		if (hash)
+			ape__log_append_record(&buf, APE__LOG_HASH, &hash_copy,
+					       sizeof(hash_copy));
+		free(copy);
+	}
+	free(ids);
+
+	ApeStrBuilder tmp = { 0 };
+	ape_sb_append_str(&tmp, path);
+	ape_sb_append_str(&tmp, ".tmp");
+	ape_da_append(&tmp, 0);
+	FILE *f = fopen(tmp.items, "wb");
+	int ok = f && fwrite(buf.items, 1, buf.count, f) == buf.count;
+	if (f && fclose(f) != 0)
+		ok = 0;
+	if (ok && rename(tmp.items, path) != 0)
+		ok = 0;
+	if (!ok) {
+		fprintf(stderr, "ERROR: Could not compact build log %s: %s\n",
+			path, strerror(errno));
+		unlink(tmp.items);
+	}
+	ape_da_free(tmp);
+	ape_da_free(buf);
+	return ok;
+}
+
+/* Opens and loads the build log, creating it if needed */
+int ape_log_open(const char *path)
+{
+	if (ape__log.fd >= 0)
+		ape__log_reset();
+	const char *slash = strrchr(path, '/');
+	if (slash) {
+		char *dir = strndup(path, slash - path + 1);
+		int ok = ape_mkdir_p(dir);
+		free(dir);
+		if (!ok)
+			return 0;
+	}
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: Could not open build log %s: %s\n",
+			path, strerror(errno));
+		return 0;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		fprintf(stderr,
+			"INFO: Waiting for another build to release %s...\n",
+			path);
+		if (flock(fd, LOCK_EX) != 0) {
+			fprintf(stderr, "ERROR: Could not lock %s: %s\n", path,
+				strerror(errno));
+			close(fd);
+			return 0;
+		}
+	}
+	ape__log.fd = fd;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		fprintf(stderr, "ERROR: Could not get stat of %s: %s\n", path,
+			strerror(errno));
+		ape__log_reset();
+		return 0;
+	}
+	size_t size = st.st_size;
+	if (size > 0) {
+		ape__log.map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ape__log.map == MAP_FAILED) {
+			fprintf(stderr, "ERROR: Could not map %s: %s\n", path,
+				strerror(errno));
+			ape__log.map = NULL;
+			ape__log_reset();
+			return 0;
+		}
+		ape__log.map_size = size;
+	}
+
+	const ApeLogHeader *header = (const ApeLogHeader *)ape__log.map;
+	size_t offset = 0;
+	if (size >= sizeof(ApeLogHeader) &&
+	    memcmp(header->magic, APE__LOG_MAGIC, sizeof(APE__LOG_MAGIC)) ==
+		    0 &&
+	    header->version == APE__LOG_VERSION)
+		offset = sizeof(ApeLogHeader);
+	while (offset > 0 && offset + sizeof(ApeLogRecord) <= size) {
+		const ApeLogRecord *rec =
+			(const ApeLogRecord *)(ape__log.map + offset);
+		const char *payload = (const char *)(rec + 1);
+		if (rec->size % 8 != 0 ||
+		    rec->size > size - offset - sizeof(ApeLogRecord))
+			break;
+		if (rec->type == APE__LOG_PATH) {
+			if (rec->size == 0 || payload[rec->size - 1] != '\0')
+				break;
+			ApeStatEntry *e = ape__path_entry(payload);
+			ape_da_append(&ape__log.paths, e->path);
+			ape_da_append(&ape__log.entries, NULL);
+			ape_da_append(&ape__log.hashes, NULL);
+			e->log_id = ape__log.paths.count;
+		} else if (rec->type == APE__LOG_HASH) {
+			const ApeLogHash *hash = (const ApeLogHash *)payload;
+			if (rec->size != sizeof(ApeLogHash) || hash->path < 1 ||
+			    hash->path > ape__log.paths.count)
+				break;
+			ape__log.hashes.items[hash->path - 1] = hash;
+			ape__log.records++;
+		} else if (rec->type == APE__LOG_ENTRY) {
+			const ApeLogEntry *entry = (const ApeLogEntry *)payload;
+			if (rec->size < sizeof(ApeLogEntry) ||
+			    rec->size != sizeof(ApeLogEntry) +
+						 entry->count *
+							 sizeof(ApeLogDep))
+				break;
+			int valid = entry->output >= 1 &&
+				    entry->output <= ape__log.paths.count;
+			for (uint32_t i = 0; valid && i < entry->count; i++)
+				valid = entry->deps[i].path >= 1 &&
+					entry->deps[i].path <=
+						ape__log.paths.count;
+			if (!valid)
+				break;
+			ape__log.entries.items[entry->output - 1] = entry;
+			ape__log.records++;
+		} else {
+			break;
+		}
+		offset += sizeof(ApeLogRecord) + rec->size;
+	}
+
+	if (offset == 0) {
+		/* Missing, outdated or corrupted header, start over */
+		ApeLogHeader fresh = { .magic = APE__LOG_MAGIC,
+				       .version = APE__LOG_VERSION };
+		if (ftruncate(fd, 0) != 0 ||
+		    !ape__log_write(&fresh, sizeof(fresh))) {
+			ape__log_reset();
+			return 0;
+		}
+	} else if (offset < size) {
+		/* Drop whatever an interrupted build left at the end */
+		if (ftruncate(fd, offset) != 0) {
+			ape__log_reset();
+			return 0;
+		}
+	}
+
+	size_t live = 0;
+	for (size_t i = 0; i < ape__log.paths.count; i++)
+		live += (ape__log.entries.items[i] != NULL) +
+			(ape__log.hashes.items[i] != NULL);
+	if (ape__log.records > APE__LOG_COMPACT_MIN &&
+	    ape__log.records > 3 * live) {
+		int ok = ape__log_compact(path);
+		ape__log_reset();
+		if (!ok)
+			return 0;
+		return ape_log_open(path);
+	}
+	return 1;
+}
+
+void ape_log_close(void)
+{
+	ape__log_reset();
+}
+
+/* Returns how long the command producing outfile took last time, 0 if that
+ * is not known */
+int64_t ape_log_duration(const char *outfile)
+{
+	if (ape__log.fd < 0)
+		return 0;
+	ApeStatEntry *e = ape__stat_cache_slot(outfile);
+	if (!e->path || !e->log_id)
+		return 0;
+	const ApeLogEntry *entry = ape__log.entries.items[e->log_id - 1];
+	return entry ? entry->duration : 0;
+}
+
+/* Returns the peak memory use of the command producing outfile last time,
+ * 0 if that is not known */
+int64_t ape_log_max_rss(const char *outfile)
+{
+	if (ape__log.fd < 0)
+		return 0;
+	ApeStatEntry *e = ape__stat_cache_slot(outfile);
+	if (!e->path || !e->log_id)
+		return 0;
+	const ApeLogEntry *entry = ape__log.entries.items[e->log_id - 1];
+	return entry ? entry->max_rss : 0;
+}
+
+/* Returns the content hash outfile was recorded with, 0 if there is none */
+uint64_t ape_log_hash(const char *outfile)
+{
+	if (ape__log.fd < 0)
+		return 0;
+	ApeStatEntry *e = ape__stat_cache_slot(outfile);
+	if (!e->path || !e->log_id)
+		return 0;
+	const ApeLogEntry *entry = ape__log.entries.items[e->log_id - 1];
+	return entry ? entry->hash : 0;
+}
+
+/* Returns -1 if there is no build log, otherwise whether the command with
+ * the given signature has to be run again to produce outfile */
+int ape_log_needs_rebuild(const char *outfile, uint64_t signature)
+{
+	if (ape__log.fd < 0)
+		return -1;
+	ApeStatEntry *e = ape__stat_cache_slot(outfile);
+	if (!e->path || !e->log_id)
+		return 1;
+	const ApeLogEntry *entry = ape__log.entries.items[e->log_id - 1];
+	if (!entry || entry->signature != signature)
+		return 1;
+	ape_stat_cache_invalidate(outfile);
+	if (!ape__log_file_unchanged(outfile, entry->mtime, entry->hash))
+		return 1;
+	for (uint32_t i = 0; i < entry->count; i++) {
+		const char *path = ape__log.paths.items[entry->deps[i].path - 1];
+		if (!ape__log_file_unchanged(path, entry->deps[i].mtime,
+					     entry->deps[i].hash))
+			return 1;
+	}
+	return 0;
+}
+
+/* A duration and max_rss of 0 keep the ones recorded last time, e.g. for
+ * outputs taken from the cache */
+int ape_log_record(const char *outfile, uint64_t signature, char **inputs,
+		   size_t len, int64_t duration, int64_t max_rss)
+{
+	ape_stat_cache_invalidate(outfile);
+	if (ape__log.fd < 0)
+		return 1;
+	const struct stat *outs = ape_stat_cached(outfile);
+	if (!outs) {
+		fprintf(stderr, "ERROR: Command did not produce %s\n",
+			outfile);
+		return 0;
+	}
+	struct stat st = *outs;
+	size_t size = sizeof(ApeLogEntry) + len * sizeof(ApeLogDep);
+	ApeLogEntry *entry = ape_arena_alloc(&ape__arena, size);
+	memset(entry, 0, size);
+	entry->signature = signature;
+	entry->mtime = ape__mtime_ns(&st);
+	entry->duration = duration ? duration : ape_log_duration(outfile);
+	entry->max_rss = max_rss ? max_rss : ape_log_max_rss(outfile);
+	entry->count = len;
+	entry->output = ape__log_path_id(outfile);
+	/* Outputs, and inputs that are outputs themselves, are always
+	 * recorded by content. A rebuilt output that comes out the same
+	 * doesn't make the jobs using it run again */
+	ape__log_file_hash(outfile, st, &entry->hash);
+	for (size_t i = 0; i < len; i++) {
+		entry->deps[i].path = ape__log_path_id(inputs[i]);
+		const struct stat *ins = ape_stat_cached(inputs[i]);
+		entry->deps[i].mtime = ins ? ape__mtime_ns(ins) : -1;
+		if (!ins || !entry->deps[i].path ||
+		    (!ape__content_hash &&
+		     !ape__log.entries.items[entry->deps[i].path - 1]))
+			continue;
+		st = *ins;
+		ape__log_file_hash(inputs[i], st, &entry->deps[i].hash);
+	}
+	for (size_t i = 0; i < len; i++)
+		if (!entry->deps[i].path)
+			entry->output = 0;
+	if (!entry->output)
+		return 0;
+	ApeStrBuilder buf = { 0 };
+	ape__log_append_record(&buf, APE__LOG_ENTRY, entry, size);
+	int ok = ape__log_write(buf.items, buf.count);
+	ape_da_free(buf);
+	if (!ok)
+		return 0;
+	ape__log.entries.items[entry->output - 1] = entry;
+	ape__log.records++;
+	return 1;
+}
+
+/*
+ * The compilation cache works like ccache's direct mode. A manifest, keyed by
+ * the compiler, the rendered command and the hash of the source, lists the
+ * headers every previous compile of it included together with their hashes.
+ * If all of those still match, the result key found next to them names an
+ * object and depfile in the cache that are put in place instead of running
+ * the compiler. Everything is written to a temporary file and renamed, so
+ * several builds can share a cache.
+ */
+#define APE__CACHE_MANIFEST_MAX 16
+
+struct {
+	char *dir;
+	uint64_t max_size;
+	uint64_t compiler;
+	uint64_t cwd;
+	size_t hits;
+	size_t misses;
+} ape__cache = { .max_size = APE_CACHE_MAX_SIZE };
+
+/* Hash of the compiler binary's path and stat data */
+uint64_t ape__cache_compiler_id(const char *name)
+{
+	ApeStrBuilder path = { 0 };
+	const char *search = strchr(name, '/') ? "" : getenv("PATH");
+	struct stat st = { 0 };
+	int found = 0;
+	while (search && !found) {
+		const char *end = strchr(search, ':');
+		size_t len = end ? (size_t)(end - search) : strlen(search);
+		path.count = 0;
+		if (len > 0) {
+			ape_da_append_many(&path, search, len);
+			ape_da_append(&path, '/');
+		}
+		ape_sb_append_str(&path, name);
+		ape_da_append(&path, 0);
+		found = stat(path.items, &st) == 0 && S_ISREG(st.st_mode);
+		search = end ? end + 1 : NULL;
+	}
+	uint64_t id = ape__hash_str(found ? path.items : name);
+	if (found) {
+		int64_t mtime = ape__mtime_ns(&st);
+		id = ape_hash64(&mtime, sizeof(mtime), id);
+		id = ape_hash64(&st.st_size, sizeof(st.st_size), id);
+	}
+	ape_da_free(path);
+	return id;
+}
+
+int ape_cache_open(const char *dir)
+{
+	ApeStrBuilder sb = { 0 };
+	ape_sb_append_str(&sb, dir);
+	if (sb.count > 0 && sb.items[sb.count - 1] != '/')
+		ape_da_append(&sb, '/');
+	ape_da_append(&sb, 0);
+	if (!ape_mkdir_p(sb.items)) {
+		ape_da_free(sb);
+		return 0;
+	}
+	ape__cache.dir = sb.items;
+	ape__cache.compiler = ape__cache_compiler_id(APECC);
+	char cwd[PATH_MAX];
+	ape__cache.cwd = ape__hash_str(getcwd(cwd, sizeof(cwd)) ? cwd : "");
+	return 1;
+}
+
+/* Returns the path of a cache file, creating its directory */
+char *ape__cache_path(const char *kind, uint64_t key, const char *suffix)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "%s/%02x/", kind,
+		 (unsigned)(key >> 56));
+	ApeStrBuilder sb = { 0 };
+	ape_sb_append_str(&sb, ape__cache.dir);
+	ape_sb_append_str(&sb, name);
+	ape_da_append(&sb, 0);
+	ape_mkdir_p(sb.items);
+	sb.count--;
+	snprintf(name, sizeof(name), "%016llx%s", (unsigned long long)key,
+		 suffix);
+	ape_sb_append_str(&sb, name);
+	ape_da_append(&sb, 0);
+	return sb.items;
+}
+
+int ape__copy_file(const char *src, const char *dst)
+{
+	int in = open(src, O_RDONLY | O_CLOEXEC);
+	if (in < 0)
+		return 0;
+	int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out < 0) {
+		close(in);
+		return 0;
+	}
+	int ok = 1;
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0) {
+		close(in);
+		return close(out) == 0;
+	}
+#endif
+	char buf[65536];
+	ssize_t n;
+	while (ok && (n = read(in, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			ok = errno == EINTR;
+			continue;
+		}
+		for (ssize_t off = 0; ok && off < n;) {
+			ssize_t w = write(out, buf + off, n - off);
+			if (w < 0)
+				ok = errno == EINTR;
+			else
+				off += w;
+		}
+	}
+	close(in);
+	if (close(out) != 0)
+		ok = 0;
+	return ok;
+}
+
+/* Atomically replaces dst with a copy of src, by reflink or copy when
+ * allow_link is 0 and by hardlink if possible otherwise */
+int ape__cache_place(const char *src, const char *dst, int allow_link)
+{
+	ApeStrBuilder tmp = { 0 };
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".tmp%d", (int)getpid());
+	ape_sb_append_str(&tmp, dst);
+	ape_sb_append_str(&tmp, suffix);
+	ape_da_append(&tmp, 0);
+	unlink(tmp.items);
+	int ok = 0;
+#ifdef FICLONE
+	if (allow_link) {
+		int in = open(src, O_RDONLY | O_CLOEXEC);
+		int out = open(tmp.items, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		ok = in >= 0 && out >= 0 && ioctl(out, FICLONE, in) == 0;
+		if (in >= 0)
+			close(in);
+		if (out >= 0)
+			close(out);
+		if (!ok)
+			unlink(tmp.items);
+	}
+#endif
+	if (!ok && allow_link)
+		ok = link(src, tmp.items) == 0;
+	if (!ok)
+		ok = ape__copy_file(src, tmp.items);
+	if (ok)
+		ok = rename(tmp.items, dst) == 0;
+	if (!ok)
+		unlink(tmp.items);
+	ape_da_free(tmp);
+	return ok;
+}
+
+int ape__file_content_hash(const char *path, struct stat st, uint64_t *hash)
+{
+	if (ape__log.fd >= 0)
+		return ape__log_file_hash(path, st, hash);
+	return ape__hash_file(path, st.st_size, hash);
+}
+
+/* Whether the objects of cmd record the directory they were built in, as
+ * debug info does unless a prefix map replaces it */
+int ape__cache_keeps_dir(ApeCmd cmd)
+{
+	int debug = 0;
+	for (size_t i = 0; i < cmd.count; i++) {
+		const char *arg = cmd.items[i];
+		if (strncmp(arg, "-g", 2) == 0)
+			debug = strcmp(arg, "-g0") != 0;
+		else if (strncmp(arg, "-fdebug-prefix-map=", 19) == 0 ||
+			 strncmp(arg, "-ffile-prefix-map=", 18) == 0)
+			return 0;
+	}
+	return debug;
+}
+
+/* Looks for a cached result of the job, putting it in place on a hit.
+ * Sets job->cache_key so that a miss is stored once the job has run */
+int ape_cache_fetch(ApeJob *job, const char *srcfile)
+{
+	if (!ape__cache.dir || !job->depfile)
+		return 0;
+	const struct stat *cached = ape_stat_cached(srcfile);
+	if (!cached)
+		return 0;
+	struct stat st = *cached;
+	uint64_t src_hash;
+	if (!ape__file_content_hash(srcfile, st, &src_hash))
+		return 0;
+	ApeStrBuilder sb = { 0 };
+	ape_cmd_render(job->cmd, &sb);
+	uint64_t key = ape_hash64(sb.items, sb.count, ape__cache.compiler);
+	/* Such objects can't be shared with other checkouts */
+	if (ape__cache_keeps_dir(job->cmd))
+		key = ape_hash64(&ape__cache.cwd, sizeof(ape__cache.cwd), key);
+	job->cache_key = ape_hash64(&src_hash, sizeof(src_hash), key);
+	ape_da_free(sb);
+
+	char *manifest = ape__cache_path("m", job->cache_key, "");
+	FILE *f = fopen(manifest, "r");
+	uint64_t result = 0;
+	char line[4096];
+	while (f && !result && fgets(line, sizeof(line), f)) {
+		unsigned long long res;
+		size_t count;
+		if (sscanf(line, "%llx %zu", &res, &count) != 2)
+			break;
+		int match = 1;
+		for (size_t i = 0; i < count; i++) {
+			unsigned long long want;
+			int offset = 0;
+			if (!fgets(line, sizeof(line), f) ||
+			    sscanf(line, "%llx %n", &want, &offset) != 1) {
+				match = 0;
+				count = i;
+				break;
+			}
+			if (!match)
+				continue;
+			line[strcspn(line, "\n")] = '\0';
+			const char *path = line + offset;
+			cached = ape_stat_cached(path);
+			uint64_t have;
+			if (!cached) {
+				match = 0;
+				continue;
+			}
+			st = *cached;
+			match = ape__file_content_hash(path, st, &have) &&
+				have == want;
+		}
+		if (match)
+			result = res;
+	}
+	if (f)
+		fclose(f);
+	if (!result) {
+		ape__cache.misses++;
+		free(manifest);
+		return 0;
+	}
+	utimensat(AT_FDCWD, manifest, NULL, 0);
+	free(manifest);
+
+	char *obj = ape__cache_path("o", result, "");
+	char *dep = ape__cache_path("o", result, ".d");
+	int ok = ape__cache_place(dep, job->depfile, 0) &&
+		 ape__cache_place(obj, job->output, 1);
+	if (ok) {
+		/* Give the object a fresh mtime, which also marks the cache
+		 * entry as recently used when it is hardlinked */
+		utimensat(AT_FDCWD, job->output, NULL, 0);
+		utimensat(AT_FDCWD, obj, NULL, 0);
+	}
+	free(obj);
+	free(dep);
+	if (!ok) {
+		ape__cache.misses++;
+		return 0;
+	}
+	ape__cache.hits++;
+	return 1;
+}
+
+/* Removes the least recently used cache files until the cache is well below
+ * its size limit, returns the resulting size */
+uint64_t ape__cache_evict(void)
+{
+	typedef struct {
+		char *path;
+		int64_t mtime;
+		uint64_t size;
+	} ApeCacheFile;
+	struct {
+		size_t capacity;
+		size_t count;
+		ApeCacheFile *items;
+	} files = { 0 };
+	uint64_t total = 0;
+	const char *kinds[] = { "m", "o" };
+	for (int k = 0; k < 2; k++) {
+		for (int i = 0; i < 256; i++) {
+			char sub[16];
+			snprintf(sub, sizeof(sub), "%s/%02x/", kinds[k], i);
+			ApeStrBuilder dirpath = { 0 };
+			ape_sb_append_str(&dirpath, ape__cache.dir);
+			ape_sb_append_str(&dirpath, sub);
+			ape_da_append(&dirpath, 0);
+			DIR *dir = opendir(dirpath.items);
+			struct dirent *entry;
+			while (dir && (entry = readdir(dir)) != NULL) {
+				struct stat st;
+				if (entry->d_name[0] == '.' ||
+				    fstatat(dirfd(dir), entry->d_name, &st,
+					    0) != 0)
+					continue;
+				ApeStrBuilder path = { 0 };
+				ape_da_append_many(&path, dirpath.items,
+						   dirpath.count - 1);
+				ape_sb_append_str(&path, entry->d_name);
+				ape_da_append(&path, 0);
+				ApeCacheFile file = {
+					.path = path.items,
+					.mtime = ape__mtime_ns(&st),
+					.size = st.st_blocks * 512,
+				};
+				ape_da_append(&files, file);
+				total += file.size;
+			}
+			if (dir)
+				closedir(dir);
+			ape_da_free(dirpath);
+		}
+	}
+	uint64_t target = ape__cache.max_size / 10 * 9;
+	while (total > target) {
+		size_t oldest = 0;
+		for (size_t i = 1; i < files.count; i++)
+			if (files.items[i].mtime < files.items[oldest].mtime)
+				oldest = i;
+		if (files.count == 0)
+			break;
+		unlink(files.items[oldest].path);
+		total -= files.items[oldest].size;
+		free(files.items[oldest].path);
+		files.items[oldest] = files.items[--files.count];
+	}
+	for (size_t i = 0; i < files.count; i++)
+		free(files.items[i].path);
+	ape_da_free(files);
+	return total;
+}
+
+/* Adds size bytes to the cache size kept in the cache's stats file, evicting
+ * old entries when it grows past the limit */
+void ape__cache_account(uint64_t size)
+{
+	ApeStrBuilder path = { 0 };
+	ape_sb_append_str(&path, ape__cache.dir);
+	ape_sb_append_str(&path, "stats");
+	ape_da_append(&path, 0);
+	int fd = open(path.items, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	ape_da_free(path);
+	if (fd < 0)
+		return;
+	if (flock(fd, LOCK_EX) == 0) {
+		char buf[32] = { 0 };
+		unsigned long long total = 0;
+		if (pread(fd, buf, sizeof(buf) - 1, 0) > 0)
+			total = strtoull(buf, NULL, 10);
+		total += size;
+		if (total > ape__cache.max_size)
+			total = ape__cache_evict();
+		int n = snprintf(buf, sizeof(buf), "%llu\n", total);
+		if (ftruncate(fd, 0) != 0 || pwrite(fd, buf, n, 0) != n)
+			fprintf(stderr,
+				"WARNING: Could not update cache stats\n");
+	}
+	close(fd);
+}
+
+/* Stores the output of a finished job in the cache, together with the
+ * hashes of the dependencies it was built from */
+int ape_cache_store(ApeJob *job, char **deps, size_t len)
+{
+	if (!ape__cache.dir || !job->cache_key)
+		return 0;
+	ApeStrBuilder entry = { 0 };
+	uint64_t result = job->cache_key;
+	for (size_t i = 0; i < len; i++) {
+		/* A dependency changed while it was being compiled, the
+		 * hashes below might not be what the compiler saw */
+		struct stat st;
+		uint64_t hash;
+		if (stat(deps[i], &st) != 0 ||
+		    ape__mtime_ns(&st) >= job->started ||
+		    !ape__file_content_hash(deps[i], st, &hash)) {
+			ape_da_free(entry);
+			return 0;
+		}
+		result = ape_hash64(&hash, sizeof(hash), result);
+		char line[32];
+		snprintf(line, sizeof(line), "%016llx ",
+			 (unsigned long long)hash);
+		ape_sb_append_str(&entry, line);
+		ape_sb_append_str(&entry, deps[i]);
+		ape_da_append(&entry, '\n');
+	}
+	if (result == 0)
+		result = 1;
+
+	char *obj = ape__cache_path("o", result, "");
+	char *dep = ape__cache_path("o", result, ".d");
+	int ok = ape__cache_place(job->depfile, dep, 0) &&
+		 ape__cache_place(job->output, obj, 0);
+	uint64_t added = 0;
+	struct stat st;
+	if (ok && stat(obj, &st) == 0)
+		added += st.st_blocks * 512;
+	free(obj);
+	free(dep);
+	if (!ok) {
+		ape_da_free(entry);
+		return 0;
+	}
+
+	/* Prepend the new entry to the manifest, keeping the newest ones */
+	char *manifest = ape__cache_path("m", job->cache_key, "");
+	ApeStrBuilder content = { 0 };
+	char header[64];
+	snprintf(header, sizeof(header), "%016llx %zu\n",
+		 (unsigned long long)result, len);
+	ape_sb_append_str(&content, header);
+	ape_da_append_many(&content, entry.items, entry.count);
+	FILE *f = fopen(manifest, "r");
+	char line[4096];
+	size_t kept = 1;
+	while (f && kept < APE__CACHE_MANIFEST_MAX &&
+	       fgets(line, sizeof(line), f)) {
+		unsigned long long res;
+		size_t count;
+		if (sscanf(line, "%llx %zu", &res, &count) != 2)
+			break;
+		if (res == result) {
+			for (size_t i = 0; i < count; i++)
+				if (!fgets(line, sizeof(line), f))
+					break;
+			continue;
+		}
+		ape_sb_append_str(&content, line);
+		for (size_t i = 0; i < count && fgets(line, sizeof(line), f);
+		     i++)
+			ape_sb_append_str(&content, line);
+		kept++;
+	}
+	if (f)
+		fclose(f);
+	ApeStrBuilder tmp = { 0 };
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".tmp%d", (int)getpid());
+	ape_sb_append_str(&tmp, manifest);
+	ape_sb_append_str(&tmp, suffix);
+	ape_da_append(&tmp, 0);
+	f = fopen(tmp.items, "w");
+	ok = f && fwrite(content.items, 1, content.count, f) == content.count;
+	if (f && fclose(f) != 0)
+		ok = 0;
+	if (ok)
+		ok = rename(tmp.items, manifest) == 0;
+	if (!ok)
+		unlink(tmp.items);
+	added += content.count;
+	ape_da_free(tmp);
+	ape_da_free(content);
+	ape_da_free(entry);
+	free(manifest);
+	ape__cache_account(added);
+	return ok;
+}
+
+int ape_endswith(char *s, const char *suffix)
+{
+	if (!s || !suffix)
+		return 0;
+	size_t lens = strlen(s);
+	size_t lensuf = strlen(suffix);
+	if (lensuf > lens)
+		return 0;
+	return strncmp(s + lens - lensuf, suffix, lensuf) == 0;
+}
+
+/* Like ape_gen_build_job, but includes the precompiled header pch (the
+ * header, not the compiled one) if not NULL. The job is made even if the
+ * object is up to date if force is set, e.g. the precompiled header is about
+ * to be rebuilt. profile, if not NULL, is an input that stands for the
+ * profile the compile uses */
+ApeJob ape__gen_build_job(char *srcfilename, uint16_t flags, ApeStrList args,
+			  const char *pch, int force, char *profile)
+{
+	ApeJob job = { .kind = APE_JOB_COMPILE };
+	srcfilename = ape_intern(srcfilename);
+	char *objfilename = ape_objfile_name(srcfilename);
+	char *depfilename = ape_depfile_name(srcfilename);
+	ape_da_reserve(&job.cmd, args.count + 10);
+	ape_cmd_append(&job.cmd, APECC);
+	for (size_t i = 0; i < args.count; i++) {
+		ape_cmd_append(&job.cmd, args.items[i]);
+	}
+#ifdef APE_BUILD_SEED_ARG
+	/* LTO objects carry random symbol names unless seeded, which would
+	 * make every recompile look changed */
+	if ((flags >> APE_FLAG_LTO) & 1) {
+		ApeStrBuilder sb = { 0 };
+		ape_sb_append_str(&sb, APE_BUILD_SEED_ARG);
+		ape_sb_append_str(&sb, srcfilename);
+		ape_cmd_append(&job.cmd,
+			       ape_arena_strndup(&ape__arena, sb.items, sb.count));
+		ape_da_free(sb);
+	}
+#endif
+#ifdef APE_BUILD_PREPROCESS_ARGS
+	/* Workers only get the preprocessed source, so the precompiled
+	 * header and the profile stay here */
+	if (!pch && !profile)
+		job.remote_flags = job.cmd.count;
+#endif
+#ifdef APE_BUILD_USE_PCH_ARGS
+	if (pch)
+		ape_cmd_append(&job.cmd, APE_BUILD_USE_PCH_ARGS(pch));
+#endif
+#ifdef APE_BUILD_DEPFILE_ARGS
+	ape_cmd_append(&job.cmd, APE_BUILD_DEPFILE_ARGS(depfilename));
+#endif
+	ape_cmd_append(&job.cmd, APE_BUILD_SRC_ARGS(srcfilename, objfilename));
+	job.signature = ape_cmd_signature(job.cmd);
+
+	int rebuild = (flags >> APE_FLAG_REBUILD) & 1 || force;
+	if (!rebuild)
+		rebuild = ape_log_needs_rebuild(objfilename, job.signature);
+	if (rebuild < 0)
+		rebuild = ape_needs_rebuild_depfile(objfilename, srcfilename,
+						    depfilename);
+	if (!rebuild) {
+		ape_cmd_free(job.cmd);
+		return (ApeJob){ 0 };
+	}
+	if (!ape__mkdir_for(objfilename)) {
+		ape_cmd_free(job.cmd);
+		return (ApeJob){ 0 };
+	}
+	job.output = objfilename;
+#ifdef APE_BUILD_DEPFILE_ARGS
+	job.depfile = depfilename;
+#endif
+	job.inputs = ape_arena_alloc(&ape__arena, 3 * sizeof(char *));
+	job.inputs[0] = srcfilename;
+	job.inputs_count = 1;
+	if (profile)
+		job.inputs[job.inputs_count++] = profile;
+#ifdef APE_PCH_EXTENSION
+	if (pch) {
+		/* The depfile only names the source, so the precompiled header
+		 * is tracked as an input of its own. It isn't reproducible, and
+		 * might not be built yet, so such compiles skip the cache */
+		job.inputs[job.inputs_count++] =
+			ape__path_with_ext(pch, APE_PCH_EXTENSION);
+		return job;
+	}
+#else
+	(void)pch;
+#endif
+	/* The cache doesn't know about the profile */
+	if (profile)
+		return job;
+	if (ape_cache_fetch(&job, srcfilename)) {
+		/* The object came from the cache, only record it */
+		job.cache_key = 0;
+		ape_job_finish(&job);
+		ape_job_free(job);
+		return (ApeJob){ 0 };
+	}
+	return job;
+}
+
+ApeJob ape_gen_build_job(char *srcfilename, uint16_t flags, ApeStrList args)
+{
+	return ape__gen_build_job(srcfilename, flags, args, NULL, 0, NULL);
+}
+
+ApeCmd ape_gen_build_command(char *srcfilename, uint16_t flags, ApeStrList args)
+{
+	return ape_gen_build_job(srcfilename, flags, args).cmd;
+}
+
+/* Whether a target is a static library, thin archives are too */
+int ape__static_lib(uint16_t flags)
+{
+	return ((flags >> APE_FLAG_STATIC_LIB) & 1) ||
+	       ((flags >> APE_FLAG_THIN_ARCHIVE) & 1);
+}
+
+ApeJob ape__gen_link_job(char *outfilename, char **srcfilenames, size_t len,
+			 uint16_t flags, ApeStrList args, int check)
+{
+	ApeJob job = { .kind = APE_JOB_LINK };
+	char **objfilenames = ape_arena_alloc(&ape__arena, len * sizeof(char *));
+	for (size_t i = 0; i < len; i++) {
+		objfilenames[i] = ape_objfile_name(srcfilenames[i]);
+	}
+	ape_da_reserve(&job.cmd, len + args.count + 8);
+	char *output;
+	ApeStrBuilder sb = { 0 };
+	ape__variant_dir(&sb);
+	if (ape__static_lib(flags)) {
+#if !defined(APEAR) || !defined(APE_STATIC_LIB_SUFFIX)
+#pragma GCC warning \
+	"You should define APEAR, APE_ARCHIVE_ARGS(outfile), APE_ARCHIVE_THIN_ARGS(outfile) and APE_STATIC_LIB_SUFFIX if you are building static libraries"
+		fprintf(stderr, "ERROR: Can't build static library %s\n",
+			outfilename);
+		ape_cmd_free(job.cmd);
+		ape_da_free(sb);
+		return (ApeJob){ 0 };
+#else
+#ifdef APE_LIB_PREFIX
+		ape_sb_append_str(&sb, APE_LIB_PREFIX);
+#endif
+		ape_sb_append_str(&sb, outfilename);
+		ape_sb_append_str(&sb, APE_STATIC_LIB_SUFFIX);
+		ape_da_append(&sb, 0);
+		output = ape_intern(sb.items);
+		job.kind = APE_JOB_ARCHIVE;
+		ape_cmd_append(&job.cmd, APEAR);
+		if ((flags >> APE_FLAG_THIN_ARCHIVE) & 1)
+			ape_cmd_append(&job.cmd, APE_ARCHIVE_THIN_ARGS(output));
+		else
+			ape_cmd_append(&job.cmd, APE_ARCHIVE_ARGS(output));
+		/* Link arguments are for the targets that use it */
+		args.count = 0;
+#endif
+	} else if ((flags >> APE_FLAG_SHARED_LIB) & 1) {
+		ape_cmd_append(&job.cmd, APELD);
+#ifndef APE_LIB_PREFIX
+#pragma GCC warning \
+	"You should define APE_LIB_PREFIX if you are building libraries"
+#else
+		ape_sb_append_str(&sb, APE_LIB_PREFIX);
+#endif
+		ape_sb_append_str(&sb, outfilename);
+#ifndef APE_LIB_SUFFIX
+#pragma GCC warning \
+	"You should define APE_LIB_SUFFIX if you are building libraries"
+#else
+		ape_sb_append_str(&sb, APE_LIB_SUFFIX);
+#endif
+		ape_da_append(&sb, 0);
+		output = ape_intern(sb.items);
+		ape_cmd_append(&job.cmd, APE_LINK_ARGS_SHARED_LIB(output));
+	} else {
+		ape_cmd_append(&job.cmd, APELD);
+		ape_sb_append_str(&sb, outfilename);
+		ape_da_append(&sb, 0);
+		output = ape_intern(sb.items);
+		ape_cmd_append(&job.cmd, APE_LINK_ARGS(output));
+	}
+	ape_da_free(sb);
+	for (size_t i = 0; i < len; i++) {
+		ape_cmd_append(&job.cmd, objfilenames[i]);
+	}
+	/* Libraries have to come after the objects that use them */
+	for (size_t i = 0; i < args.count; i++) {
+		ape_cmd_append(&job.cmd, args.items[i]);
+	}
+	job.signature = ape_cmd_signature(job.cmd);
+
+	int rebuild = !check || ((flags >> APE_FLAG_REBUILD) & 1);
+	if (!rebuild)
+		rebuild = ape_log_needs_rebuild(output, job.signature);
+	if (rebuild < 0)
+		rebuild = ape_needs_rebuild(output, objfilenames, len);
+	if (!rebuild) {
+		ape_cmd_free(job.cmd);
+		return (ApeJob){ 0 };
+	}
+	ape__mkdir_for(output);
+	job.output = output;
+	job.inputs = objfilenames;
+	job.inputs_count = len;
+	return job;
+}
+
+ApeJob ape_gen_link_job(char *outfilename, char **srcfilenames, size_t len,
+			uint16_t flags, ApeStrList args)
+{
+	return ape__gen_link_job(outfilename, srcfilenames, len, flags, args,
+				 1);
+}
+
+ApeCmd ape_gen_link_command(char *outfilename, char **srcfilenames, size_t len,
+			    uint16_t flags, ApeStrList args)
+{
+	return ape_gen_link_job(outfilename, srcfilenames, len, flags, args)
+		.cmd;
+}
+
+struct {
+	size_t capacity;
+	size_t count;
+	ApeBuilder *items;
+} ape__builder_list;
+
+struct {
+	size_t capacity;
+	size_t count;
+	ApeVariant *items;
+} ape__variant_list;
+
+/* Variants to build, from --variant. The first one defined if empty */
+ApeStrList ape__variant_names;
+
+/* Maximum number of commands run at once, set with -j */
+size_t ape__jobs;
+
+#ifndef APE_UNITY_BATCH_SIZE
+#define APE_UNITY_BATCH_SIZE (256 * 1024)
+#endif
+
+#ifndef APE_BATCH_MAX_SOURCES
+#define APE_BATCH_MAX_SOURCES 16
+#endif
+
+/* Writes content to path unless the file already holds exactly that, so
+ * that unchanged unity sources keep their mtime */
+int ape__write_if_changed(const char *path, const char *content, size_t len)
+{
+	/* Generated by the build, not an input for watch mode */
+	ape__path_entry(path)->watch = 2;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		struct stat st;
+		int same = 0;
+		if (fstat(fd, &st) == 0 && (size_t)st.st_size == len) {
+			char *old = malloc(len + 1);
+			same = read(fd, old, len + 1) == (ssize_t)len &&
+			       memcmp(old, content, len) == 0;
+			free(old);
+		}
+		close(fd);
+		if (same)
+			return 1;
+	}
+	ApeStrBuilder tmp = { 0 };
+	ape_sb_append_str(&tmp, path);
+	ape_sb_append_str(&tmp, ".tmp");
+	ape_da_append(&tmp, 0);
+	fd = open(tmp.items, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	int ok = fd >= 0 && write(fd, content, len) == (ssize_t)len;
+	if (fd >= 0)
+		ok = close(fd) == 0 && ok;
+	ok = ok && rename(tmp.items, path) == 0;
+	if (!ok) {
+		fprintf(stderr, "ERROR: Could not write %s: %s\n", path,
+			strerror(errno));
+		unlink(tmp.items);
+	}
+	ape_stat_cache_invalidate(path);
+	ape_da_free(tmp);
+	return ok;
+}
+
+int ape__unity_excluded(ApeBuilder *builder, const char *path)
+{
+	if (strncmp(path, "./", 2) == 0)
+		path += 2;
+	for (size_t i = 0; i < builder->unity_exclude.count; i++) {
+		const char *ex = builder->unity_exclude.items[i];
+		if (strncmp(ex, "./", 2) == 0)
+			ex += 2;
+		if (strcmp(ex, path) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Appends the way back to the working directory from the directory dir: a
+ * "../" for each of its components if it is below it, or the working
+ * directory itself if dir is absolute or goes up */
+void ape__append_back(ApeStrBuilder *sb, const char *dir)
+{
+	int below = dir[0] != '/';
+	size_t up = 0;
+	for (const char *p = dir; below && *p;) {
+		size_t len = strcspn(p, "/");
+		if (len == 2 && strncmp(p, "..", 2) == 0)
+			below = 0;
+		else if (len > 1 || (len == 1 && *p != '.'))
+			up++;
+		p += len;
+		while (*p == '/')
+			p++;
+	}
+	if (below) {
+		for (size_t i = 0; i < up; i++)
+			ape_sb_append_str(sb, "../");
+		return;
+	}
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd)))
+		return;
+	ape_sb_append_str(sb, cwd);
+	if (strcmp(cwd, "/") != 0)
+		ape_da_append(sb, '/');
+}
+
+/* Appends an #include of path to a file generated in dir */
+void ape__append_include(ApeStrBuilder *sb, const char *dir, const char *path)
+{
+	ape_sb_append_str(sb, "#include \"");
+	if (path[0] != '/')
+		ape__append_back(sb, dir);
+	ape_sb_append_str(sb, path);
+	ape_sb_append_str(sb, "\"\n");
+}
+
+/* Writes one unity source including the sources [first, last) */
+char *ape__unity_write(ApeBuilder *builder, char **srcs, size_t first,
+		       size_t last)
+{
+	/* Named after the first member, so a batch keeps its name when others
+	 * change */
+	char name[64];
+	snprintf(name, sizeof(name), "-%016llx" APE_SRC_EXTENSION,
+		 (unsigned long long)ape__hash_str(srcs[first]));
+	ApeStrBuilder path = { 0 };
+	ape_sb_append_str(&path, APE__OUTPUT_DIR("unity/"));
+	ape_sb_append_str(&path, builder->outfile);
+	ape_sb_append_str(&path, name);
+	ape_da_append(&path, 0);
+
+	ApeStrBuilder content = { 0 };
+	ape_sb_append_str(&content, "/* Generated by apebuild, do not edit */\n");
+	for (size_t i = first; i < last; i++)
+		ape__append_include(&content, APE__OUTPUT_DIR("unity/"),
+				    srcs[i]);
+	int ok = ape__write_if_changed(path.items, content.items, content.count);
+	char *r = ok ? ape_intern(path.items) : NULL;
+	ape_da_free(content);
+	ape_da_free(path);
+	return r;
+}
+
+/* Removes unity sources of the builder that no batch uses anymore */
+void ape__unity_clean(ApeBuilder *builder, char **keep, size_t len)
+{
+	DIR *dir = opendir(APE__OUTPUT_DIR("unity"));
+	if (!dir)
+		return;
+	size_t prefix = strlen(builder->outfile);
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		const char *n = entry->d_name;
+		if (strncmp(n, builder->outfile, prefix) != 0 ||
+		    n[prefix] != '-' ||
+		    strspn(n + prefix + 1, "0123456789abcdef") != 16)
+			continue;
+		ApeStrBuilder path = { 0 };
+		ape_sb_append_str(&path, APE__OUTPUT_DIR("unity/"));
+		ape_sb_append_str(&path, n);
+		ape_da_append(&path, 0);
+		int used = 0;
+		for (size_t i = 0; i < len && !used; i++)
+			used = strncmp(keep[i], path.items,
+				       strlen(keep[i])) == 0;
+		if (!used)
+			unlink(path.items);
+		ape_da_free(path);
+	}
+	closedir(dir);
+}
+
+int ape__strcmp_ptr(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Replaces the sources of a unity builder by generated sources that each
+ * include a batch of them. Batches are contiguous runs of the sorted sources,
+ * ending at the first source after about the target size whose path hashes
+ * to a boundary (or at twice the target size). A boundary depends only on
+ * the source itself, so adding or removing one source only changes its own
+ * batch and rarely the next one, and the unity sources of all the others are
+ * left alone. Excluded sources are compiled on their own.
+ */
+int ape__unity_sources(ApeBuilder *builder, ApeStrList *srcs)
+{
+	ApeStrList members = { 0 };
+	uint64_t total = 0;
+	for (size_t i = 0; i < builder->infiles.count; i++) {
+		char *src = builder->infiles.items[i];
+		if (ape__unity_excluded(builder, src)) {
+			ape_da_append(srcs, src);
+			continue;
+		}
+		ape_da_append(&members, src);
+		const struct stat *st = ape_stat_cached(src);
+		total += st ? (uint64_t)st->st_size : 0;
+	}
+	if (members.count == 0)
+		return 1;
+	qsort(members.items, members.count, sizeof(char *), ape__strcmp_ptr);
+	if (!ape_mkdir_p(APE__OUTPUT_DIR("unity"))) {
+		ape_da_free(members);
+		return 0;
+	}
+	uint64_t target = builder->unity_batches ?
+				  total / builder->unity_batches :
+				  APE_UNITY_BATCH_SIZE;
+	if (target == 0)
+		target = 1;
+	size_t first_unity = srcs->count;
+	size_t start = 0;
+	uint64_t size = 0;
+	int ok = 1;
+	for (size_t i = 0; ok && i < members.count; i++) {
+		const struct stat *st = ape_stat_cached(members.items[i]);
+		size += st ? (uint64_t)st->st_size : 0;
+		int boundary = (ape__hash_str(members.items[i]) & 3) == 0;
+		if (i + 1 < members.count &&
+		    !(size >= target && boundary) && size < 2 * target)
+			continue;
+		char *unity =
+			ape__unity_write(builder, members.items, start, i + 1);
+		if (unity)
+			ape_da_append(srcs, unity);
+		ok = unity != NULL;
+		start = i + 1;
+		size = 0;
+	}
+	if (ok)
+		ape__unity_clean(builder, srcs->items + first_unity,
+				 srcs->count - first_unity);
+	ape_da_free(members);
+	return ok;
+}
+
+/*
+ * Generates the job precompiling the header of a builder. The header is
+ * precompiled from a stub in <variant dir>/pch/<target>/ that includes it,
+ * which the compiles then include instead, so that every builder gets its
+ * own precompiled header built with its own flags, and a compile that can't
+ * use it still finds the header. Sets *stub to the stub and returns a job
+ * without a command if the precompiled header is up to date.
+ */
+ApeJob ape__gen_pch_job(ApeBuilder *builder, ApeStrList args, char **stub)
+{
+	ApeJob job = { .kind = APE_JOB_PCH };
+	*stub = NULL;
+#ifdef APE_BUILD_PCH_ARGS
+	ApeStrBuilder dir = { 0 };
+	ape__variant_dir(&dir);
+	ape_sb_append_str(&dir, "pch/");
+	ape_sb_append_str(&dir, builder->outfile);
+	ape_da_append(&dir, '/');
+	ape_da_append(&dir, 0);
+	const char *name = strrchr(builder->pch, '/');
+	name = name ? name + 1 : builder->pch;
+	ApeStrBuilder path = { 0 };
+	ape_sb_append_str(&path, dir.items);
+	ape_sb_append_str(&path, name);
+	ape_da_append(&path, 0);
+	ApeStrBuilder content = { 0 };
+	ape_sb_append_str(&content, "/* Generated by apebuild, do not edit */\n");
+	ape__append_include(&content, dir.items, builder->pch);
+	int ok = ape_mkdir_p(dir.items) &&
+		 ape__write_if_changed(path.items, content.items,
+				       content.count);
+	char *header = ape_intern(path.items);
+	ape_da_free(content);
+	ape_da_free(path);
+	ape_da_free(dir);
+	if (!ok)
+		return job;
+	*stub = header;
+	char *gch = ape_intern(ape__path_with_ext(header, APE_PCH_EXTENSION));
+	char *depfile = ape__path_with_ext(gch, APE_DEP_EXTENSION);
+
+	ape_da_reserve(&job.cmd, args.count + 10);
+	ape_cmd_append(&job.cmd, APECC);
+	for (size_t i = 0; i < args.count; i++)
+		ape_cmd_append(&job.cmd, args.items[i]);
+#ifdef APE_BUILD_DEPFILE_ARGS
+	ape_cmd_append(&job.cmd, APE_BUILD_DEPFILE_ARGS(depfile));
+#endif
+	ape_cmd_append(&job.cmd, APE_BUILD_PCH_ARGS(header, gch));
+	job.signature = ape_cmd_signature(job.cmd);
+
+	int rebuild = (builder->flags >> APE_FLAG_REBUILD) & 1;
+	if (!rebuild)
+		rebuild = ape_log_needs_rebuild(gch, job.signature);
+	if (rebuild < 0)
+		rebuild = ape_needs_rebuild_depfile(gch, header, depfile);
+	if (!rebuild) {
+		ape_cmd_free(job.cmd);
+		return (ApeJob){ 0 };
+	}
+	job.output = gch;
+#ifdef APE_BUILD_DEPFILE_ARGS
+	job.depfile = depfile;
+#endif
+	job.inputs = ape_arena_alloc(&ape__arena, sizeof(char *));
+	job.inputs[0] = header;
+	job.inputs_count = 1;
+#else
+	(void)args;
+	fprintf(stderr,
+		"WARNING: Define APE_BUILD_PCH_ARGS(infile, outfile) to precompile %s\n",
+		builder->pch);
+#endif
+	return job;
+}
+
+#ifdef APE_BUILD_BATCH_ARGS
+/* Options whose path argument is relative to the working directory, either
+ * attached or as the next argument */
+const char *ape__path_options[] = { "-I", "-iquote", "-isystem",
+				    "-idirafter", "-include", "-imacros",
+				    NULL };
+
+/* Appends args to cmd for a command run in a directory that prefix leads
+ * back from, with the relative paths of ape__path_options prefixed */
+void ape__cmd_append_rebased(ApeCmd *cmd, const char **args, size_t n,
+			     const char *prefix)
+{
+	int path_next = 0;
+	for (size_t i = 0; i < n; i++) {
+		const char *arg = args[i];
+		int is_path = path_next;
+		size_t optlen = 0;
+		path_next = 0;
+		for (const char **opt = ape__path_options; !is_path && *opt;
+		     opt++) {
+			size_t len = strlen(*opt);
+			if (strncmp(arg, *opt, len) != 0)
+				continue;
+			if (arg[len] == '\0') {
+				path_next = 1;
+			} else {
+				is_path = 1;
+				optlen = len;
+			}
+			break;
+		}
+		if (!is_path || arg[optlen] == '/' || arg[optlen] == '=') {
+			ape_da_append(cmd, arg);
+			continue;
+		}
+		ApeStrBuilder sb = { 0 };
+		ape_da_append_many(&sb, arg, optlen);
+		ape_sb_append_str(&sb, prefix);
+		ape_sb_append_str(&sb, arg + optlen);
+		ape_da_append(cmd,
+			      ape_arena_strndup(&ape__arena, sb.items, sb.count));
+		ape_da_free(sb);
+	}
+}
+
+/* The name a source's object gets when compiled without -o */
+const char *ape__batch_stem(const char *src, size_t *len)
+{
+	const char *slash = strrchr(src, '/');
+	const char *stem = slash ? slash + 1 : src;
+	const char *dot = strrchr(stem, '.');
+	*len = dot && dot != stem ? (size_t)(dot - stem) : strlen(stem);
+	return stem;
+}
+
+char *ape__prefix_map_arg(const char *from, const char *to)
+{
+	ApeStrBuilder sb = { 0 };
+	ape_sb_append_str(&sb, APE_BUILD_PREFIX_MAP_ARG);
+	ape_sb_append_str(&sb, from);
+	ape_da_append(&sb, '=');
+	ape_sb_append_str(&sb, to);
+	char *arg = ape_arena_strndup(&ape__arena, sb.items, sb.count);
+	ape_da_free(sb);
+	return arg;
+}
+
+/* Adds a batch compile of the n compiles members of graph, run in a
+ * directory of its own where the compiler names the objects after the
+ * sources */
+void ape__batch_add(ApeBuilder *builder, ApeJobList *graph, size_t *members,
+		    size_t n, ApeStrList args, const char *pch, size_t pch_job)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx/",
+		 (unsigned long long)(ape__hash_str(
+					      graph->items[members[0]].inputs[0]) ^
+				      ape__hash_str(builder->outfile)));
+	ApeStrBuilder sb = { 0 };
+	ape__variant_dir(&sb);
+	ape_sb_append_str(&sb, "batch/");
+	ape_sb_append_str(&sb, name);
+	ape_da_append(&sb, 0);
+	char *dir = ape_intern(sb.items);
+	if (!ape__mkdir_for(dir)) {
+		ape_da_free(sb);
+		return;
+	}
+	/* The way back to our directory */
+	sb.count = 0;
+	ape__append_back(&sb, dir);
+	ape_da_append(&sb, 0);
+	char *back = ape_intern(sb.items);
+
+	ApeJob job = { .kind = APE_JOB_BATCH, .cwd = dir };
+	ape_da_reserve(&job.cmd, args.count + n + 8);
+	ape_cmd_append(&job.cmd, APECC);
+	ape__cmd_append_rebased(&job.cmd, (const char **)args.items,
+				args.count, back);
+#ifdef APE_BUILD_USE_PCH_ARGS
+	if (pch) {
+		const char *use[] = { APE_BUILD_USE_PCH_ARGS(pch) };
+		ape__cmd_append_rebased(&job.cmd, use,
+					sizeof(use) / sizeof(use[0]), back);
+	}
+#endif
+	/* Map the paths seen from the batch directory back to ours, so that
+	 * __FILE__ and the debug info are the same as in a compile of its own */
+	char cwd[PATH_MAX];
+	ape_cmd_append(&job.cmd, ape__prefix_map_arg(back, ""));
+	if (getcwd(cwd, sizeof(cwd))) {
+		sb.count = 0;
+		ape_sb_append_str(&sb, cwd);
+		ape_sb_append_str(&sb, "/");
+		ape_da_append(&sb, 0);
+		/* Where the compiler runs, as it sees it */
+		ApeStrBuilder abs = { 0 };
+		ape__path_resolve(&abs, sb.items, dir);
+		ape_da_append(&abs, 0);
+		ape_cmd_append(&job.cmd, ape__prefix_map_arg(abs.items, cwd));
+		ape_da_free(abs);
+	}
+	ape_cmd_append(&job.cmd, APE_BUILD_BATCH_ARGS);
+	job.inputs = ape_arena_alloc(&ape__arena, n * sizeof(char *));
+	for (size_t i = 0; i < n; i++) {
+		ApeJob *member = &graph->items[members[i]];
+		char *src = member->inputs[0];
+		job.inputs[job.inputs_count++] = src;
+		sb.count = 0;
+		if (src[0] != '/')
+			ape_sb_append_str(&sb, back);
+		ape_sb_append_str(&sb, src);
+		ape_da_append(&job.cmd, ape_arena_strndup(&ape__arena, sb.items,
+							  sb.count));
+		size_t len;
+		const char *stem = ape__batch_stem(src, &len);
+		sb.count = 0;
+		ape_sb_append_str(&sb, dir);
+		ape_da_append_many(&sb, stem, len);
+		ape_sb_append_str(&sb, APE_OBJ_EXTENSION);
+		member->batch_obj =
+			ape_arena_strndup(&ape__arena, sb.items, sb.count);
+		ape_da_append(&member->deps, graph->count);
+	}
+	if (pch_job != SIZE_MAX)
+		ape_da_append(&job.deps, pch_job);
+	ape_da_free(sb);
+	ape_da_append(graph, job);
+}
+
+/* Groups the compiles from first on in graph into batch compiles, with as
+ * many sources in each as still gives every job slot a batch */
+void ape__batch_jobs(ApeBuilder *builder, ApeJobList *graph, size_t first,
+		     ApeStrList args, const char *pch, size_t pch_job)
+{
+	size_t end = graph->count;
+	size_t slots = ape__jobs > 0 ? ape__jobs : 1;
+	size_t size = (end - first + slots - 1) / slots;
+	if (size > APE_BATCH_MAX_SOURCES)
+		size = APE_BATCH_MAX_SOURCES;
+	if (size < 2)
+		return;
+	size_t *members = malloc(size * sizeof(size_t));
+	size_t count = 0;
+	for (size_t i = first; i < end; i++) {
+		ApeJob *job = &graph->items[i];
+		if (job->kind != APE_JOB_COMPILE)
+			continue;
+		/* Sources with the same name would write the same object, the
+		 * later one is compiled on its own */
+		size_t len, other_len;
+		const char *stem = ape__batch_stem(job->inputs[0], &len);
+		int clash = 0;
+		for (size_t j = 0; !clash && j < count; j++) {
+			const char *other = ape__batch_stem(
+				graph->items[members[j]].inputs[0], &other_len);
+			clash = len == other_len &&
+				strncmp(stem, other, len) == 0;
+		}
+		if (clash)
+			continue;
+		members[count++] = i;
+		if (count == size) {
+			ape__batch_add(builder, graph, members, count, args,
+				       pch, pch_job);
+			count = 0;
+		}
+	}
+	if (count > 1)
+		ape__batch_add(builder, graph, members, count, args, pch,
+			       pch_job);
+	free(members);
+}
+#endif
+
+/* Adds the compiles of a builder and its link with the given arguments to
+ * graph. With a profile_job, whose output is the profile the compiles use,
+ * every compile is added and only run if it is out of date or the profile
+ * changed. Returns the index of the link job */
+size_t ape__builder_add_build(ApeBuilder *builder, ApeJobList *graph,
+			      ApeStrList build_args, ApeStrList link_args,
+			      size_t profile_job)
+{
+	char *profile = profile_job != SIZE_MAX ?
+				graph->items[profile_job].output :
+				NULL;
+	int rebuild = (builder->flags >> APE_FLAG_REBUILD) & 1;
+	char *pch = NULL;
+	size_t pch_job = SIZE_MAX;
+	if (builder->pch) {
+		ApeJob j = ape__gen_pch_job(builder, build_args, &pch);
+		if (j.cmd.items) {
+			pch_job = graph->count;
+			ape_da_append(graph, j);
+		}
+	}
+	size_t first = graph->count;
+	ApeStrList srcs = { 0 };
+	if ((builder->flags >> APE_FLAG_UNITY) & 1) {
+		if (!ape__unity_sources(builder, &srcs)) {
+			fprintf(stderr,
+				"WARNING: Building %s without unity sources\n",
+				builder->outfile);
+			srcs.count = 0;
+		}
+	}
+	if (srcs.count == 0)
+		ape_da_append_many(&srcs, builder->infiles.items,
+				   builder->infiles.count);
+	for (size_t i = 0; i < srcs.count; i++) {
+		ApeJob j = ape__gen_build_job(srcs.items[i], builder->flags,
+					      build_args, pch,
+					      pch_job != SIZE_MAX || profile,
+					      profile);
+		if (!j.cmd.items)
+			continue;
+		if (pch_job != SIZE_MAX)
+			ape_da_append(&j.deps, pch_job);
+		if (profile) {
+			ape_da_append(&j.deps, profile_job);
+			j.lazy = pch_job == SIZE_MAX && !rebuild;
+		}
+		ape_da_append(graph, j);
+	}
+#ifdef APE_BUILD_BATCH_ARGS
+	/* Batches are only made of compiles known to run, and can't seed
+	 * each LTO object on its own */
+	if ((builder->flags >> APE_FLAG_BATCH) & 1 && !profile &&
+	    !((builder->flags >> APE_FLAG_LTO) & 1))
+		ape__batch_jobs(builder, graph, first, build_args, pch,
+				pch_job);
+#endif
+	ApeJob link = ape__gen_link_job(builder->outfile, srcs.items,
+					srcs.count, builder->flags, link_args,
+					0);
+	link.lazy = !rebuild;
+	for (size_t i = first; i < graph->count; i++)
+		ape_da_append(&link.deps, i);
+	ape_da_append(graph, link);
+	ape_da_free(srcs);
+	return graph->count - 1;
+}
+
+#ifdef APE_PGO_GENERATE_ARG
+/* Returns opt followed by the absolute path of dir, without a trailing '/' */
+char *ape__pgo_path_arg(const char *opt, const char *dir)
+{
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd)))
+		cwd[0] = '\0';
+	ApeStrBuilder sb = { 0 };
+	ape_sb_append_str(&sb, opt);
+	if (dir[0] != '/') {
+		ape_sb_append_str(&sb, cwd);
+		ape_da_append(&sb, '/');
+	}
+	ape_sb_append_str(&sb, dir);
+	while (sb.count > 0 && sb.items[sb.count - 1] == '/')
+		sb.count--;
+	char *arg = ape_arena_strndup(&ape__arena, sb.items, sb.count);
+	ape_da_free(sb);
+	return arg;
+}
+
+/* Appends s quoted for sh */
+void ape__sh_quote(ApeStrBuilder *sb, const char *s)
+{
+	ape_da_append(sb, '\'');
+	for (; *s; s++) {
+		if (*s == '\'')
+			ape_sb_append_str(sb, "'\\''");
+		else
+			ape_da_append(sb, *s);
+	}
+	ape_da_append(sb, '\'');
+}
+
+/* Adds a build of a target with profile guided optimization: an
+ * instrumented build of it in the pgo/ directory of the variant, a job that
+ * does the training runs of it, and the optimized build using the profile
+ * they leave. The profile is kept until the instrumented binary changes, and
+ * the optimized objects are only rebuilt when it comes out different.
+ * Returns the index of the optimized link */
+size_t ape__pgo_add_jobs(ApeBuilder *builder, ApeJobList *graph,
+			 ApeStrList build_args, ApeStrList link_args)
+{
+	const ApeVariant *variant = ape__current_variant;
+	ApeStrBuilder sb = { 0 };
+	ape__variant_dir(&sb);
+	size_t dirlen = sb.count;
+	ape_sb_append_str(&sb, "obj");
+	ape_da_append(&sb, 0);
+	/* The profile of an object is named after its path relative to the
+	 * object directory, so both builds find the same one */
+	char *prefix = ape__pgo_path_arg(APE_PGO_PREFIX_ARG, sb.items);
+	sb.count = dirlen;
+	ape_sb_append_str(&sb, "pgo/profile");
+	ape_da_append(&sb, 0);
+	char *profile_dir = ape__pgo_path_arg("", sb.items);
+	sb.count = dirlen;
+	ape_sb_append_str(&sb, "pgo/");
+	ape_sb_append_str(&sb, builder->outfile);
+	ape_sb_append_str(&sb, ".profile");
+	ape_da_append(&sb, 0);
+	char *stamp = ape_intern(sb.items);
+
+	/* The instrumented build is a variant of its own */
+	sb.count = 0;
+	if (variant) {
+		ape_sb_append_str(&sb, variant->name);
+		ape_da_append(&sb, '/');
+	}
+	ape_sb_append_str(&sb, "pgo");
+	ape_da_append(&sb, 0);
+	ApeVariant instrumented = { .name = ape_intern(sb.items) };
+	ape__current_variant = &instrumented;
+	sb.count = 0;
+	ape__variant_dir(&sb);
+	ape_sb_append_str(&sb, "obj");
+	ape_da_append(&sb, 0);
+	char *generate = ape__pgo_path_arg(APE_PGO_GENERATE_ARG, profile_dir);
+	ApeStrList gen_build_args = { 0 };
+	ApeStrList gen_link_args = { 0 };
+	ape_da_append_many(&gen_build_args, build_args.items, build_args.count);
+	ape_da_append(&gen_build_args, generate);
+	ape_da_append(&gen_build_args,
+		      ape__pgo_path_arg(APE_PGO_PREFIX_ARG, sb.items));
+	ape_da_append(&gen_link_args, generate);
+	ape_da_append_many(&gen_link_args, link_args.items, link_args.count);
+	size_t gen_first = graph->count;
+	size_t gen_link = ape__builder_add_build(builder, graph, gen_build_args,
+						 gen_link_args, SIZE_MAX);
+	/* Instrumented objects name their profile after their own path */
+	for (size_t i = gen_first; i < gen_link; i++)
+		graph->items[i].remote_flags = 0;
+	ape__current_variant = variant;
+	char *binary = graph->items[gen_link].output;
+
+	/* Training starts from an empty profile, and the stamp it leaves is
+	 * all of the profile, so that an unchanged one doesn't rebuild
+	 * anything */
+	ApeJob train = { .output = stamp, .lazy = 1 };
+	sb.count = 0;
+	ape_sb_append_str(&sb, "rm -rf ");
+	ape__sh_quote(&sb, profile_dir);
+	ape_da_append(&sb, ' ');
+	ape__sh_quote(&sb, stamp);
+	for (size_t i = 0; i < builder->pgo_train.count; i++) {
+		ApeCmd run = builder->pgo_train.items[i];
+		ape_sb_append_str(&sb, " && ");
+		ape__sh_quote(&sb, binary);
+		for (size_t j = 1; j < run.count; j++) {
+			ape_da_append(&sb, ' ');
+			ape__sh_quote(&sb, run.items[j]);
+		}
+	}
+	ape_sb_append_str(&sb, " && cat ");
+	ape__sh_quote(&sb, profile_dir);
+	ape_sb_append_str(&sb, "/*" APE_PGO_PROFILE_EXTENSION " > ");
+	ape__sh_quote(&sb, stamp);
+	ape_cmd_append(&train.cmd, "sh", "-c",
+		       ape_arena_strndup(&ape__arena, sb.items, sb.count));
+	train.signature = ape_cmd_signature(train.cmd);
+	sb.count = 0;
+	ape_sb_append_str(&sb, "Training ");
+	ape_sb_append_str(&sb, binary);
+	train.description = ape_arena_strndup(&ape__arena, sb.items, sb.count);
+	ape_da_append(&train.deps, gen_link);
+	/* Train again if the profile is gone or came from other runs */
+	if (ape__job_needs_run(&train))
+		train.lazy = 0;
+	size_t train_job = graph->count;
+	ape_da_append(graph, train);
+
+	ApeStrList use_build_args = { 0 };
+	ape_da_append_many(&use_build_args, build_args.items, build_args.count);
+	ape_da_append(&use_build_args,
+		      ape__pgo_path_arg(APE_PGO_USE_ARG, profile_dir));
+	ape_da_append(&use_build_args, prefix);
+	ape_cmd_append(&use_build_args, APE_PGO_USE_ARGS);
+	size_t link = ape__builder_add_build(builder, graph, use_build_args,
+					     link_args, train_job);
+	ape_da_free(sb);
+	ape_da_free(gen_build_args);
+	ape_da_free(gen_link_args);
+	ape_da_free(use_build_args);
+	return link;
+}
+#endif
+
+ssize_t ape__find_builder(const char *name)
+{
+	for (size_t i = 0; i < ape__builder_list.count; i++)
+		if (strcmp(ape__builder_list.items[i].outfile, name) == 0)
+			return i;
+	return -1;
+}
+
+/* Static libraries don't carry the libraries they use, so the link arguments
+ * of those a target depends on are added to its own, up to depth levels
+ * down */
+void ape__static_link_args(ApeBuilder *builder, ApeStrList *link_args,
+			   size_t depth)
+{
+	for (size_t i = 0; depth > 0 && i < builder->depends.count; i++) {
+		ssize_t dep = ape__find_builder(builder->depends.items[i]);
+		if (dep < 0)
+			continue;
+		ApeBuilder *lib = &ape__builder_list.items[dep];
+		if (!ape__static_lib(lib->flags))
+			continue;
+		ape_da_append_many(link_args, lib->extra_link_args.items,
+				   lib->extra_link_args.count);
+		ape__static_link_args(lib, link_args, depth - 1);
+	}
+}
+
+void ape__builder_dedup_files(ApeBuilder *builder);
+
+/* Adds the out of date compiles of a builder and its link to graph. The link
+ * depends on the compiles and is only run if one of them ran or it is out of
+ * date itself. Returns the index of the link job */
+size_t ape_builder_add_jobs(ApeBuilder *builder, ApeJobList *graph)
+{
+	ape__builder_dedup_files(builder);
+	/* The flags of the variant come first, so the target's can override
+	 * them */
+	const ApeVariant *variant = ape__current_variant;
+	ApeStrList build_args = { 0 };
+	ApeStrList link_args = { 0 };
+	if (variant) {
+		ape_da_append_many(&build_args, variant->build_args.items,
+				   variant->build_args.count);
+		ape_da_append_many(&link_args, variant->link_args.items,
+				   variant->link_args.count);
+	}
+	ape_da_append_many(&build_args, builder->extra_build_args.items,
+			   builder->extra_build_args.count);
+#ifdef APE_LINK_ARGS_ADD_LIBDIR
+	/* Libraries of the targets it depends on are in the same directory */
+	if (builder->depends.count > 0) {
+		ApeStrBuilder libdir = { 0 };
+		ape_sb_append_str(&libdir, APE_LINK_ARGS_ADD_LIBDIR(""));
+		ape__variant_dir(&libdir);
+		ape_da_append(&libdir, 0);
+		ape_da_append(&link_args, ape_intern(libdir.items));
+		ape_da_free(libdir);
+	}
+#endif
+	ape_da_append_many(&link_args, builder->extra_link_args.items,
+			   builder->extra_link_args.count);
+	ape__static_link_args(builder, &link_args, ape__builder_list.count);
+#if defined(APE_BUILD_ARGS_LTO) && defined(APE_LINK_ARGS_LTO)
+	/* The link runs the code generation in parallel, sharing our job
+	 * slots through the jobserver */
+	if ((builder->flags >> APE_FLAG_LTO) & 1) {
+		ape_cmd_append(&build_args, APE_BUILD_ARGS_LTO);
+		ape_cmd_append(&link_args, APE_LINK_ARGS_LTO);
+	}
+#endif
+
+	size_t link;
+#ifdef APE_PGO_GENERATE_ARG
+	int lib = (builder->flags >> APE_FLAG_SHARED_LIB) & 1 ||
+		  ape__static_lib(builder->flags);
+	if (builder->pgo_train.count > 0 && lib)
+		fprintf(stderr,
+			"WARNING: Building %s without PGO, libraries can't be "
+			"trained\n",
+			builder->outfile);
+	if (builder->pgo_train.count > 0 && !lib)
+		link = ape__pgo_add_jobs(builder, graph, build_args, link_args);
+	else
+#endif
+		link = ape__builder_add_build(builder, graph, build_args,
+					      link_args, SIZE_MAX);
+	ape_da_free(build_args);
+	ape_da_free(link_args);
+	return link;
+}
+
+ApeJobList ape_builder_gen_jobs(ApeBuilder *builder)
+{
+	ApeJobList jl = { 0 };
+	ape_builder_add_jobs(builder, &jl);
+	return jl;
+}
+
+ApeCmdList ape_builder_gen_commands(ApeBuilder *builder)
+{
+	ApeJobList jl = ape_builder_gen_jobs(builder);
+	ApeCmdList cl = { 0 };
+	for (size_t i = 0; i < jl.count; i++) {
+		ApeJob *j = &jl.items[i];
+		/* Only the link is lazy, anything rebuilt before it means it
+		 * has to run as well. The compiles of a batch run on their own,
+		 * as a command list has no working directories */
+		if (j->kind == APE_JOB_BATCH)
+			ape_cmd_free(j->cmd);
+		else if (jl.count > 1 || !j->lazy || ape__job_needs_run(j))
+			ape_da_append(&cl, j->cmd);
+		else
+			ape_cmd_free(j->cmd);
+		/* The inputs are in the arena */
+		ape_da_free(j->deps);
+	}
+	ape_da_free(jl);
+	return cl;
+}
+
+int ape__gen_graph_builder(size_t b, ApeJobList *graph, int *marks,
+			   size_t *links)
+{
+	ApeBuilder *builder = &ape__builder_list.items[b];
+	if (marks[b] == 2)
 		return 1;
+	if (marks[b] == 1) {
+		fprintf(stderr, "ERROR: Dependency cycle involving %s\n",
+			builder->outfile);
+		return 0;
 	}
-	while ((entry = readdir(dir)) != NULL) {
-		if (entry->d_name[0] == '.')
+	marks[b] = 1;
+	for (size_t i = 0; i < builder->depends.count; i++) {
+		ssize_t dep = ape__find_builder(builder->depends.items[i]);
+		if (dep < 0) {
+			fprintf(stderr,
+				"ERROR: %s depends on unknown target %s\n",
+				builder->outfile, builder->depends.items[i]);
+			return 0;
+		}
+		if (!ape__gen_graph_builder(dep, graph, marks, links))
+			return 0;
+	}
+#if !defined(APEAR) || !defined(APE_STATIC_LIB_SUFFIX)
+	if (ape__static_lib(builder->flags)) {
+		fprintf(stderr,
+			"ERROR: Can't build static library %s without APEAR "
+			"and APE_STATIC_LIB_SUFFIX\n",
+			builder->outfile);
+		return 0;
+	}
+#endif
+	if (ape__current_variant)
+		fprintf(stderr, "INFO: Building %s (%s)...\n",
+			builder->outfile, ape__current_variant->name);
+	else
+		fprintf(stderr, "INFO: Building %s...\n", builder->outfile);
+	int64_t start = ape__now_ns();
+	size_t first = graph->count;
+	size_t link = ape_builder_add_jobs(builder, graph);
+	ape__trace_span("check", builder->outfile, start, 0, NULL, NULL);
+	/* The links, the instrumented one of PGO too, also wait on the links
+	 * of the targets it depends on and are redone when their outputs
+	 * change. So do archives, whose dependents link those targets too */
+	for (size_t j = first; j <= link; j++) {
+		ApeJob *job = &graph->items[j];
+		if (job->kind != APE_JOB_LINK && job->kind != APE_JOB_ARCHIVE)
 			continue;
-		if (!ape_endswith(entry->d_name, APE_SRC_EXTENSION))
-			continue;
-		ApeStrBuilder pathbuilder = { 0 };
-		ape_sb_append_str(&pathbuilder, path);
-		if (pathbuilder.items[pathbuilder.count - 1] != '/')
-			ape_da_append(&pathbuilder, '/');
-		ape_sb_append_str(&pathbuilder, entry->d_name);
-		ape_da_append(&pathbuilder, 0);
-		struct stat statbuf;
-		if (stat(pathbuilder.items, &statbuf) < 0) {
-			fprintf(stderr, "ERROR: Could not get stat of %s: %s\n",
-				pathbuilder.items, strerror(errno));
-			return 1;
+		ApeStrList inputs = { 0 };
+		ape_da_append_many(&inputs, job->inputs, job->inputs_count);
+		for (size_t i = 0; i < builder->depends.count; i++) {
+			ssize_t d = ape__find_builder(builder->depends.items[i]);
+			ApeJob *dep = &graph->items[links[d]];
+			ape_da_append(&job->deps, links[d]);
+			ape_da_append(&inputs, dep->output);
+			/* A thin archive stays the same when its objects
+			 * change, they are what is linked */
+			uint16_t flags = ape__builder_list.items[d].flags;
+			if ((flags >> APE_FLAG_THIN_ARCHIVE) & 1)
+				ape_da_append_many(&inputs, dep->inputs,
+						   dep->inputs_count);
 		}
-		if ((statbuf.st_mode & S_IFMT) == S_IFREG)
-			ape_builder_append_file(builder,
-						strdup(pathbuilder.items));
-		ape_da_free(pathbuilder);
+		job->inputs = ape_arena_alloc(&ape__arena,
+					      inputs.count * sizeof(char *));
+		memcpy(job->inputs, inputs.items, inputs.count * sizeof(char *));
+		job->inputs_count = inputs.count;
+		ape_da_free(inputs);
 	}
-	return 0;
+	marks[b] = 2;
+	links[b] = link;
+	return 1;
 }
 
-int ape_builder_append_dir_recursive(ApeBuilder *builder, char *path)
+/* Finds the variants named in --variant, "all" for every one of them */
+int ape__select_variants(const ApeVariant ***selected, size_t *count)
 {
-	DIR *dir = opendir(path);
-	struct dirent *entry;
-	if (!dir) {
-		fprintf(stderr, "ERROR: Could not open directory %s\n", path);
+	*count = 0;
+	*selected = malloc((ape__variant_list.count + 1) *
+			   sizeof(ApeVariant *));
+	if (ape__variant_list.count == 0) {
+		if (ape__variant_names.count > 0) {
+			fprintf(stderr, "ERROR: No variants are defined\n");
+			return 0;
+		}
+		(*selected)[(*count)++] = NULL;
+		return 1;
+	}
+	if (ape__variant_names.count == 0) {
+		(*selected)[(*count)++] = &ape__variant_list.items[0];
 		return 1;
 	}
+	char *used = calloc(ape__variant_list.count, 1);
+	int ok = 1;
+	for (size_t i = 0; ok && i < ape__variant_names.count; i++) {
+		const char *name = ape__variant_names.items[i];
+		int all = strcmp(name, "all") == 0, found = 0;
+		for (size_t v = 0; v < ape__variant_list.count; v++) {
+			if (!all && strcmp(ape__variant_list.items[v].name,
+					   name) != 0)
+				continue;
+			found = 1;
+			if (!used[v])
+				(*selected)[(*count)++] =
+					&ape__variant_list.items[v];
+			used[v] = 1;
+		}
+		if (!found) {
+			fprintf(stderr, "ERROR: Unknown variant %s\n", name);
+			ok = 0;
+		}
+	}
+	free(used);
+	return ok;
+}
+
+/* Puts the jobs of every builder into a single graph, so that compiles of
+ * independent targets can run at the same time. With several variants
+ * selected, every target is added once per variant. Returns 0 if a target
+ * depends on an unknown target, there is a dependency cycle or the toolchain
+ * can't build one */
+int ape_gen_graph(ApeJobList *graph)
+{
+	const ApeVariant **variants;
+	size_t nvariants;
+	int ok = ape__select_variants(&variants, &nvariants);
+	size_t n = ape__builder_list.count;
+	int *marks = malloc((n + 1) * sizeof(int));
+	size_t *links = malloc((n + 1) * sizeof(size_t));
+	for (size_t v = 0; ok && v < nvariants; v++) {
+		ape__current_variant = variants[v];
+		memset(marks, 0, (n + 1) * sizeof(int));
+		memset(links, 0, (n + 1) * sizeof(size_t));
+		for (size_t i = 0; ok && i < n; i++)
+			ok = ape__gen_graph_builder(i, graph, marks, links);
+	}
+	ape__current_variant = NULL;
+	free(variants);
+	free(marks);
+	free(links);
+	return ok;
+}
+
+/* Appends the sources found by a directory scan to the input list of the
+ * builder, sorted so that their order doesn't depend on the file system.
+ * Files added one by one keep the order they were given in, which is the
+ * link order */
+void ape__builder_merge_files(ApeBuilder *builder, char **paths, size_t len)
+{
+	qsort(paths, len, sizeof(char *), ape__strcmp_ptr);
+	ape_da_append_many(&builder->infiles, paths, len);
+}
+
+/* Orders entries of a string list by their string, then by their place */
+int ape__strcmp_entry(const void *a, const void *b)
+{
+	char **x = *(char **const *)a;
+	char **y = *(char **const *)b;
+	int r = strcmp(*x, *y);
+	return r ? r : (x > y) - (x < y);
+}
+
+/* Drops the sources of the builder that were added more than once, e.g. by
+ * overlapping directories, keeping the first */
+void ape__builder_dedup_files(ApeBuilder *builder)
+{
+	size_t n = builder->infiles.count;
+	if (n < 2)
+		return;
+	char ***sorted = malloc(n * sizeof(char **));
+	for (size_t i = 0; i < n; i++)
+		sorted[i] = &builder->infiles.items[i];
+	qsort(sorted, n, sizeof(char **), ape__strcmp_entry);
+	const char *prev = *sorted[0];
+	for (size_t i = 1; i < n; i++) {
+		if (strcmp(prev, *sorted[i]) == 0)
+			*sorted[i] = NULL;
+		else
+			prev = *sorted[i];
+	}
+	free(sorted);
+	size_t count = 0;
+	for (size_t i = 0; i < n; i++)
+		if (builder->infiles.items[i])
+			builder->infiles.items[count++] =
+				builder->infiles.items[i];
+	builder->infiles.count = count;
+}
+
+void ape_builder_append_file(ApeBuilder *builder, char *path)
+{
+	ape_da_append(&builder->infiles, path);
+}
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	ApeStrList dirs;
+	ApeStrList files;
+	/* Every directory read, for watch mode */
+	ApeStrList scanned;
+	size_t busy;
+	int recursive;
+	int failed;
+} ApeScan;
+
+
+/*
+ * Reads one directory, appending sources to files and, when recursing,
+ * subdirectories to dirs. The entry type comes from d_type so a stat is only
+ * needed for symlinks and filesystems that report DT_UNKNOWN.
+ */
+int ape__scan_dir(ApeArena *arena, const char *path, int recursive,
+		  ApeStrList *dirs, ApeStrList *files)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+	if (!dir) {
+		fprintf(stderr, "ERROR: Could not open directory %s: %s\n",
+			path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	size_t plen = strlen(path);
+	int slash = plen > 0 && path[plen - 1] == '/';
+	size_t extlen = strlen(APE_SRC_EXTENSION);
+	struct dirent *entry;
 	while ((entry = readdir(dir)) != NULL) {
 		if (entry->d_name[0] == '.')
 			continue;
-		ApeStrBuilder pathbuilder = { 0 };
-		ape_sb_append_str(&pathbuilder, path);
-		if (pathbuilder.items[pathbuilder.count - 1] != '/')
-			ape_da_append(&pathbuilder, '/');
-		ape_sb_append_str(&pathbuilder, entry->d_name);
-		ape_da_append(&pathbuilder, 0);
-		struct stat statbuf;
-		if (stat(pathbuilder.items, &statbuf) < 0) {
-			fprintf(stderr, "ERROR: Could not get stat of %s: %s\n",
-				pathbuilder.items, strerror(errno));
-			return 1;
+		size_t nlen = strlen(entry->d_name);
+		int is_src = nlen >= extlen &&
+			     memcmp(entry->d_name + nlen - extlen,
+				    APE_SRC_EXTENSION, extlen) == 0;
+		if (!is_src && !recursive)
+			continue;
+		unsigned char type = entry->d_type;
+		if (type == DT_UNKNOWN || type == DT_LNK) {
+			struct stat statbuf;
+			if (fstatat(fd, entry->d_name, &statbuf, 0) < 0) {
+				fprintf(stderr,
+					"ERROR: Could not get stat of %s/%s: %s\n",
+					path, entry->d_name, strerror(errno));
+				closedir(dir);
+				return 0;
+			}
+			type = S_ISDIR(statbuf.st_mode) ? DT_DIR :
+			       S_ISREG(statbuf.st_mode) ? DT_REG :
+							  DT_UNKNOWN;
+		}
+		if (type != DT_DIR && !(type == DT_REG && is_src))
+			continue;
+		char *full = ape_arena_alloc(arena, plen + !slash + nlen + 1);
+		memcpy(full, path, plen);
+		if (!slash)
+			full[plen] = '/';
+		memcpy(full + plen + !slash, entry->d_name, nlen + 1);
+		if (type == DT_DIR) {
+			if (recursive)
+				ape_da_append(dirs, full);
+		} else {
+			ape_da_append(files, full);
+		}
+	}
+	closedir(dir);
+	return 1;
+}
+
+void *ape__scan_worker(void *arg)
+{
+	ApeScan *scan = arg;
+	ApeArena arena = { 0 };
+	ApeStrList dirs = { 0 };
+	ApeStrList files = { 0 };
+	pthread_mutex_lock(&scan->lock);
+	for (;;) {
+		while (scan->dirs.count == 0 && scan->busy > 0 && !scan->failed)
+			pthread_cond_wait(&scan->cond, &scan->lock);
+		if (scan->dirs.count == 0 || scan->failed)
+			break;
+		char *path = scan->dirs.items[--scan->dirs.count];
+		ape_da_append(&scan->scanned, path);
+		scan->busy++;
+		pthread_mutex_unlock(&scan->lock);
+
+		dirs.count = 0;
+		files.count = 0;
+		int ok = ape__scan_dir(&arena, path, scan->recursive, &dirs,
+				       &files);
+
+		pthread_mutex_lock(&scan->lock);
+		scan->busy--;
+		if (!ok)
+			scan->failed = 1;
+		if (dirs.count > 0)
+			ape_da_append_many(&scan->dirs, dirs.items, dirs.count);
+		if (files.count > 0)
+			ape_da_append_many(&scan->files, files.items,
+					   files.count);
+		pthread_cond_broadcast(&scan->cond);
+	}
+	pthread_cond_broadcast(&scan->cond);
+	pthread_mutex_unlock(&scan->lock);
+	ape_da_free(dirs);
+	ape_da_free(files);
+	/* The chunks hold result paths, hand them over to the shared arena */
+	if (arena.head) {
+		pthread_mutex_lock(&scan->lock);
+		ApeArenaChunk *last = arena.head;
+		while (last->next)
+			last = last->next;
+		last->next = ape__arena.head;
+		ape__arena.head = arena.head;
+		pthread_mutex_unlock(&scan->lock);
+	}
+	return NULL;
+}
+
+#ifndef APE_SCAN_THREADS
+#define APE_SCAN_THREADS 8
+#endif
+
+int ape__builder_scan(ApeBuilder *builder, char *path, int recursive)
+{
+	int64_t start = ape__now_ns();
+	ApeScan scan = { .recursive = recursive };
+	pthread_mutex_init(&scan.lock, NULL);
+	pthread_cond_init(&scan.cond, NULL);
+	ape_da_append(&scan.dirs, path);
+
+	pthread_t threads[APE_SCAN_THREADS];
+	size_t nthreads = 0;
+	if (recursive) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		size_t want = cpus > 1 ? (size_t)cpus : 1;
+		if (want > APE_SCAN_THREADS)
+			want = APE_SCAN_THREADS;
+		for (; nthreads + 1 < want; nthreads++)
+			if (pthread_create(&threads[nthreads], NULL,
+					   ape__scan_worker, &scan) != 0)
+				break;
+	}
+	ape__scan_worker(&scan);
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (!scan.failed)
+		ape__builder_merge_files(builder, scan.files.items,
+					 scan.files.count);
+	ApeStrList *dirs = recursive ? &builder->source_dirs_rec :
+				       &builder->source_dirs;
+	for (size_t i = 0; i < scan.scanned.count; i++) {
+		const char *dir = scan.scanned.items[i];
+		size_t len = strlen(dir);
+		int slash = len > 0 && dir[len - 1] == '/';
+		char *prefix = ape_arena_alloc(&ape__arena, len + 2);
+		memcpy(prefix, dir, len);
+		memcpy(prefix + len, "/", !slash + 1);
+		prefix[len + !slash] = 0;
+		ape_da_append(dirs, prefix);
+	}
+	ape_da_free(scan.scanned);
+	ape_da_free(scan.dirs);
+	ape_da_free(scan.files);
+	pthread_cond_destroy(&scan.cond);
+	pthread_mutex_destroy(&scan.lock);
+	ape__trace_span("scan", path, start, 0, NULL, NULL);
+	return scan.failed;
+}
+
+int ape_builder_append_dir(ApeBuilder *builder, char *path)
+{
+	return ape__builder_scan(builder, path, 0);
+}
+
+int ape_builder_append_dir_recursive(ApeBuilder *builder, char *path)
+{
+	return ape__builder_scan(builder, path, 1);
+}
+
+/* Generates the graph of all builders and runs it */
+int ape__build(void)
+{
+	ApeJobList graph = { 0 };
+	int ok = ape_gen_graph(&graph);
+	if (ok) {
+		size_t started = ape__jobs_started;
+		ok = ape_jobs_run_parallel(graph, ape__jobs);
+		if (ok && started == ape__jobs_started)
+			fprintf(stderr, "INFO: Nothing to build!\n");
+	}
+	for (size_t i = 0; i < graph.count; i++)
+		ape_job_free(graph.items[i]);
+	ape_da_free(graph);
+	return ok;
+}
+
+/*
+ * Watch mode. After the first build the builders, the build log and the stat
+ * cache stay in memory, and inotify watches the directories the sources were
+ * scanned from, the directories of every input recorded in the build log
+ * (discovered headers included) and the build script. A burst of events is
+ * collected until it has been quiet for APE_WATCH_DEBOUNCE_MS, then only the
+ * changed paths are stat'ed again and the graph is regenerated from the log,
+ * so only the affected objects and links run. Sources created in or deleted
+ * from a scanned directory are added to or removed from their builders, and
+ * new subdirectories of recursively scanned ones are scanned on their own.
+ * A change to the build script execs the binary again, so that APE_REBUILD
+ * rebuilds it.
+ */
+#ifndef APE_WATCH_DEBOUNCE_MS
+#define APE_WATCH_DEBOUNCE_MS 100
+#endif
+
+typedef struct {
+	int wd;
+	/* Prefix of the paths in the directory, "" or ending in '/' */
+	char *prefix;
+} ApeWatchDir;
+
+struct {
+	int fd;
+	struct {
+		size_t capacity;
+		size_t count;
+		ApeWatchDir *items;
+	} dirs;
+	/* The build script changed */
+	int reexec;
+} ape__watch = { .fd = -1 };
+
+/* Build script set by APE_REBUILD and the files it was built from, watched
+ * for changes */
+const char *ape__script;
+ApeStrList ape__script_deps;
+/* The path of the build binary, which argv[0] isn't if it came from PATH */
+const char *ape__binary;
+
+/* The files the build binary was built from are recorded in <binary>.deps,
+ * after the signature of the command that built it, each with the mtime and
+ * size it had. The binary is up to date as long as they and the binary itself
+ * still have those */
+#define APE__REBUILD_MAGIC "apebuild-rebuild 1"
+
+/* Whether the build binary has to be rebuilt, -1 if nothing was recorded
+ * about it */
+int ape__rebuild_needed(const char *binpath, uint64_t signature)
+{
+	FILE *f = fopen(ape__path_with_ext(binpath, ".deps"), "rb");
+	if (!f)
+		return -1;
+	char line[PATH_MAX + 64];
+	unsigned long long recorded;
+	int needed = !fgets(line, sizeof(line), f) ||
+		     sscanf(line, APE__REBUILD_MAGIC " %llx", &recorded) != 1 ||
+		     recorded != signature;
+	while (!needed && fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		long long mtime, size;
+		int off = 0;
+		if (sscanf(line, "%lld %lld %n", &mtime, &size, &off) != 2 ||
+		    off == 0) {
+			needed = 1;
+			break;
 		}
-		if ((statbuf.st_mode & S_IFMT) == S_IFDIR)
-			ape_builder_append_dir_recursive(
-				builder, strdup(pathbuilder.items));
-		if (!ape_endswith(entry->d_name, APE_SRC_EXTENSION))
+		const char *path = line + off;
+		struct stat st;
+		needed = stat(path, &st) != 0 || ape__mtime_ns(&st) != mtime ||
+			 st.st_size != size;
+		if (strcmp(path, binpath) != 0)
+			ape_da_append(&ape__script_deps, ape_intern(path));
+	}
+	fclose(f);
+	return needed;
+}
+
+/* Records the files in the depfile of the rebuild, or just the build script
+ * if there is none */
+int ape__rebuild_record(const char *binpath, const char *srcpath,
+			uint64_t signature)
+{
+	char *depfile = ape__path_with_ext(binpath, ".d");
+	ApeStrList deps = { 0 };
+	if (!ape_parse_depfile(depfile, &deps) || deps.count == 0)
+		ape_da_append(&deps, ape_intern(srcpath));
+	unlink(depfile);
+	ape_da_append(&deps, (char *)binpath);
+	ape__script_deps.count = 0;
+	ApeStrBuilder content = { 0 };
+	char line[128];
+	snprintf(line, sizeof(line), APE__REBUILD_MAGIC " %016llx\n",
+		 (unsigned long long)signature);
+	ape_sb_append_str(&content, line);
+	for (size_t i = 0; i < deps.count; i++) {
+		struct stat st;
+		if (stat(deps.items[i], &st) != 0)
 			continue;
-		if ((statbuf.st_mode & S_IFMT) == S_IFREG)
-			ape_builder_append_file(builder,
-						strdup(pathbuilder.items));
-		ape_da_free(pathbuilder);
+		snprintf(line, sizeof(line), "%lld %lld ",
+			 (long long)ape__mtime_ns(&st), (long long)st.st_size);
+		ape_sb_append_str(&content, line);
+		ape_sb_append_str(&content, deps.items[i]);
+		ape_da_append(&content, '\n');
+		if (i + 1 < deps.count)
+			ape_da_append(&ape__script_deps, deps.items[i]);
+	}
+	char *stamp = ape__path_with_ext(binpath, ".deps");
+	FILE *f = fopen(stamp, "wb");
+	int ok = f && fwrite(content.items, 1, content.count, f) ==
+			      content.count;
+	if (f)
+		ok = fclose(f) == 0 && ok;
+	if (!ok) {
+		fprintf(stderr, "WARNING: Could not write %s: %s\n", stamp,
+			strerror(errno));
+		unlink(stamp);
+	}
+	ape_da_free(content);
+	ape_da_free(deps);
+	return ok;
+}
+
+/* Rebuilds the build binary if the build script or a header it includes
+ * changed since it was built, and replaces the process with the new one.
+ * The remote compiles of a build also run through here */
+void ape__rebuild(int argc, char **argv, const char *srcpath)
+{
+	assert(argc >= 1);
+#ifdef APE_BUILD_PREPROCESS_ARGS
+	if (argc > 1 && strcmp(argv[1], APE__REMOTE_ARG) == 0)
+		exit(ape__remote_client(argc, argv));
+	ape__remote_entry = 1;
+#endif
+	ape__script = srcpath;
+	for (int i = 1; i < argc; i++)
+		ape__trace_arg(argv[i]);
+	/* Started through PATH, argv[0] is only the name */
+	const char *binpath = argv[0];
+	char self[PATH_MAX];
+	ssize_t len = -1;
+	if (!strchr(binpath, '/'))
+		len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len > 0) {
+		self[len] = '\0';
+		binpath = ape_intern(self);
+	}
+	ape__binary = binpath;
+	int64_t start = ape__now_ns();
+	ApeCmd rebuild = { 0 };
+	ape_cmd_append(&rebuild, APE_REBUILD_COMMAND(binpath, srcpath));
+#ifdef APE_REBUILD_DEPFILE_ARGS
+	ape_cmd_append(&rebuild, APE_REBUILD_DEPFILE_ARGS(ape__path_with_ext(
+					 binpath, ".d")));
+#endif
+	uint64_t signature = ape_cmd_signature(rebuild);
+	int needed = ape__rebuild_needed(binpath, signature);
+	if (needed < 0) {
+		/* Built by hand, as when bootstrapping, so only the script is
+		 * known to have gone into it */
+		char *src = (char *)srcpath;
+		needed = ape_stat_cached(src) &&
+			 ape__needs_rebuild(binpath, &src, 1, 1);
+		if (!needed)
+			ape__rebuild_record(binpath, srcpath, signature);
+	}
+	if (!needed) {
+		ape_cmd_free(rebuild);
+		ape__trace_rebuild(start, 0);
+		return;
+	}
+	ApeStrBuilder old = { 0 };
+	ape_sb_append_str(&old, binpath);
+	ape_sb_append_str(&old, ".old");
+	ape_da_append(&old, '\0');
+	if (!ape_rename(binpath, old.items))
+		exit(1);
+	if (!ape_cmd_run_sync(rebuild)) {
+		ape_rename(old.items, binpath);
+		exit(1);
+	}
+	ape_cmd_free(rebuild);
+	ape_da_free(old);
+	ape__rebuild_record(binpath, srcpath, signature);
+	ape__trace_rebuild(start, 1);
+	execvp(binpath, argv);
+	fprintf(stderr, "ERROR: Could not run %s: %s\n", binpath,
+		strerror(errno));
+	exit(1);
+}
+
+/* Set with --watch */
+int ape__watch_mode;
+
+/* Watches the directory holding the paths starting with prefix[0..len) */
+void ape__watch_dir(const char *prefix, size_t len)
+{
+	for (size_t i = 0; i < ape__watch.dirs.count; i++) {
+		const char *p = ape__watch.dirs.items[i].prefix;
+		if (strlen(p) == len && strncmp(p, prefix, len) == 0)
+			return;
+	}
+	char *p = ape_arena_strndup(&ape__arena, prefix, len);
+	int wd = inotify_add_watch(ape__watch.fd, len ? p : ".",
+				   IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE |
+					   IN_DELETE | IN_MOVED_FROM |
+					   IN_MOVED_TO | IN_ONLYDIR);
+	if (wd < 0) {
+		if (errno != ENOENT)
+			fprintf(stderr, "WARNING: Could not watch %s: %s\n",
+				len ? p : ".", strerror(errno));
+		return;
+	}
+	ape_da_append(&ape__watch.dirs, ((ApeWatchDir){ wd, p }));
+}
+
+/* Marks path as an input whose changes trigger a rebuild, and watches it */
+void ape__watch_input(const char *path)
+{
+	ApeStatEntry *e = ape__path_entry(path);
+	if (e->watch)
+		return;
+	e->watch = 1;
+	const char *slash = strrchr(path, '/');
+	ape__watch_dir(path, slash ? (size_t)(slash - path) + 1 : 0);
+}
+
+/* Watches the sources, the inputs in the build log and the build script */
+void ape__watch_update(void)
+{
+	for (size_t i = 0; i < ape__log.entries.count; i++) {
+		const ApeLogEntry *entry = ape__log.entries.items[i];
+		if (entry)
+			ape__path_entry(ape__log.paths.items[entry->output - 1])
+				->watch = 2;
+	}
+	for (size_t i = 0; i < ape__log.entries.count; i++) {
+		const ApeLogEntry *entry = ape__log.entries.items[i];
+		for (uint32_t j = 0; entry && j < entry->count; j++)
+			ape__watch_input(
+				ape__log.paths.items[entry->deps[j].path - 1]);
+	}
+	for (size_t i = 0; i < ape__builder_list.count; i++) {
+		ApeBuilder *b = &ape__builder_list.items[i];
+		for (size_t j = 0; j < b->source_dirs.count; j++)
+			ape__watch_dir(b->source_dirs.items[j],
+				       strlen(b->source_dirs.items[j]));
+		for (size_t j = 0; j < b->source_dirs_rec.count; j++)
+			ape__watch_dir(b->source_dirs_rec.items[j],
+				       strlen(b->source_dirs_rec.items[j]));
+		for (size_t j = 0; j < b->infiles.count; j++)
+			ape__watch_input(b->infiles.items[j]);
+		if (b->pch)
+			ape__watch_input(b->pch);
 	}
+	if (ape__script)
+		ape__watch_input(ape__script);
+	for (size_t i = 0; i < ape__script_deps.count; i++)
+		ape__watch_input(ape__script_deps.items[i]);
+}
+
+int ape__strlist_contains(ApeStrList *list, const char *s)
+{
+	for (size_t i = 0; i < list->count; i++)
+		if (strcmp(list->items[i], s) == 0)
+			return 1;
 	return 0;
 }
 
+/* Adds or removes a source created in or deleted from directory prefix */
+int ape__watch_source(const char *prefix, char *path, int created)
+{
+	int changed = 0;
+	for (size_t i = 0; i < ape__builder_list.count; i++) {
+		ApeBuilder *b = &ape__builder_list.items[i];
+		if (!ape__strlist_contains(&b->source_dirs, prefix) &&
+		    !ape__strlist_contains(&b->source_dirs_rec, prefix))
+			continue;
+		char **items = b->infiles.items;
+		size_t n = b->infiles.count;
+		char **found = NULL;
+		for (size_t j = 0; !found && j < n; j++)
+			if (strcmp(items[j], path) == 0)
+				found = &items[j];
+		if (created && !found) {
+			ape_builder_append_file(b, ape_intern(path));
+			changed = 1;
+		} else if (!created && found) {
+			memmove(found, found + 1,
+				(items + n - found - 1) * sizeof(char *));
+			b->infiles.count--;
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+/* Scans a directory created in the recursively scanned directory prefix */
+int ape__watch_new_dir(const char *prefix, char *path)
+{
+	int changed = 0;
+	for (size_t i = 0; i < ape__builder_list.count; i++) {
+		ApeBuilder *b = &ape__builder_list.items[i];
+		if (ape__strlist_contains(&b->source_dirs_rec, prefix)) {
+			ape__builder_scan(b, ape_intern(path), 1);
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+/* Handles an inotify event, returns 1 if it calls for a rebuild */
+int ape__watch_event(const struct inotify_event *ev)
+{
+	if (ev->mask & IN_Q_OVERFLOW) {
+		fprintf(stderr,
+			"WARNING: Missed file changes, checking all inputs\n");
+		for (size_t i = 0; i < ape__stat_cache.capacity; i++)
+			ape__stat_cache.items[i].valid = 0;
+		return 1;
+	}
+	int changed = 0;
+	size_t extlen = strlen(APE_SRC_EXTENSION);
+	size_t nlen = ev->len ? strlen(ev->name) : 0;
+	for (size_t i = 0; i < ape__watch.dirs.count; i++) {
+		ApeWatchDir *dir = &ape__watch.dirs.items[i];
+		if (dir->wd != ev->wd)
+			continue;
+		if (ev->mask & IN_IGNORED) {
+			/* The directory is gone, watch it again if it comes
+			 * back */
+			ape__watch.dirs.items[i--] =
+				ape__watch.dirs.items[--ape__watch.dirs.count];
+			continue;
+		}
+		if (nlen == 0 || ev->name[0] == '.')
+			continue;
+		ApeStrBuilder path = { 0 };
+		ape_da_reserve(&path, strlen(dir->prefix) + nlen + 1);
+		ape_sb_append_str(&path, dir->prefix);
+		ape_sb_append_str(&path, ev->name);
+		ape_da_append(&path, 0);
+		if (ev->mask & IN_ISDIR) {
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+				changed |= ape__watch_new_dir(dir->prefix,
+							      path.items);
+			ape_da_free(path);
+			continue;
+		}
+		ApeStatEntry *e = ape__stat_cache_slot(path.items);
+		if (e->path) {
+			e->valid = 0;
+			changed |= e->watch == 1;
+			if ((ape__script && strcmp(e->path, ape__script) == 0) ||
+			    ape__strlist_contains(&ape__script_deps, e->path))
+				ape__watch.reexec = 1;
+		}
+		if ((!e->path || e->watch != 2) && nlen >= extlen &&
+		    strcmp(ev->name + nlen - extlen, APE_SRC_EXTENSION) == 0) {
+			int created = (ev->mask & (IN_DELETE | IN_MOVED_FROM)) == 0;
+			changed |= ape__watch_source(dir->prefix, path.items,
+						     created);
+		}
+		ape_da_free(path);
+	}
+	return changed;
+}
+
+/* Rebuilds whenever inputs change, until interrupted */
+int ape__watch_run(char **argv)
+{
+	ape__watch.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (ape__watch.fd < 0) {
+		fprintf(stderr, "ERROR: Could not start watching: %s\n",
+			strerror(errno));
+		return 0;
+	}
+	struct sigaction sa = { .sa_handler = ape__forward_signal };
+	sigemptyset(&sa.sa_mask);
+	struct sigaction old_int, old_term;
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+	ape__watch_update();
+	int ok = 1;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (!ape__interrupted) {
+		fprintf(stderr, "INFO: Watching for changes...\n");
+		int changed = 0;
+		int timeout = -1;
+		while (!ape__interrupted) {
+			struct pollfd pfd = { .fd = ape__watch.fd,
+					      .events = POLLIN };
+			int n = poll(&pfd, 1, timeout);
+			if (n == 0)
+				break;
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				fprintf(stderr, "ERROR: Could not watch: %s\n",
+					strerror(errno));
+				ape__interrupted = SIGTERM;
+				ok = 0;
+				break;
+			}
+			ssize_t len;
+			while ((len = read(ape__watch.fd, buf, sizeof(buf))) > 0) {
+				for (char *p = buf; p < buf + len;) {
+					const struct inotify_event *ev =
+						(const struct inotify_event *)p;
+					changed |= ape__watch_event(ev);
+					p += sizeof(*ev) + ev->len;
+				}
+			}
+			if (changed)
+				timeout = APE_WATCH_DEBOUNCE_MS;
+		}
+		if (ape__interrupted)
+			break;
+		if (ape__watch.reexec) {
+			fprintf(stderr,
+				"INFO: The build script changed, restarting\n");
+			ape_log_close();
+			ape_jobserver_close();
+			sigaction(SIGINT, &old_int, NULL);
+			sigaction(SIGTERM, &old_term, NULL);
+			const char *binary = ape__binary ? ape__binary : argv[0];
+			execvp(binary, argv);
+			fprintf(stderr, "ERROR: Could not restart %s: %s\n",
+				binary, strerror(errno));
+			return 0;
+		}
+		ok = ape__build();
+		ape__watch_update();
+	}
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	close(ape__watch.fd);
+	ape__watch.fd = -1;
+	ape_da_free(ape__watch.dirs);
+	return ok;
+}
+
 int ape_run_builder(ApeBuilder *builder)
 {
-	ApeCmdList cmds = ape_builder_gen_commands(builder);
-	if (!cmds.items)
+	ApeJobList jobs = ape_builder_gen_jobs(builder);
+	size_t started = ape__jobs_started;
+	int r = ape_jobs_run_parallel(jobs, ape__jobs);
+	if (r && started == ape__jobs_started)
 		fprintf(stderr, "INFO: Nothing to build!\n");
-	int r = ape_cmds_run(cmds);
-	ape_da_free(cmds);
+	for (size_t i = 0; i < jobs.count; i++)
+		ape_job_free(jobs.items[i]);
+	ape_da_free(jobs);
 	return r;
 }
 
+/* Directory of the compilation cache, "" for the default location */
+#ifdef APE_CACHE_DIR
+const char *ape__cache_dir = APE_CACHE_DIR;
+#else
+const char *ape__cache_dir = NULL;
+#endif
+
+/* $XDG_CACHE_HOME/apebuild, falling back to ~/.cache/apebuild */
+char *ape__default_cache_dir(void)
+{
+	ApeStrBuilder sb = { 0 };
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if (xdg && *xdg) {
+		ape_sb_append_str(&sb, xdg);
+	} else if (home && *home) {
+		ape_sb_append_str(&sb, home);
+		ape_sb_append_str(&sb, "/.cache");
+	} else {
+		return NULL;
+	}
+	ape_sb_append_str(&sb, "/apebuild");
+	ape_da_append(&sb, 0);
+	return sb.items;
+}
+
+/* Set when -j was given */
+int ape__jobs_given;
+
+/* Parses the apebuild options out of argv, returns 0 on invalid input */
+int ape__parse_args(int argc, char **argv)
+{
+	long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+	ape__jobs = nproc > 0 ? (size_t)nproc : 1;
+	ape__jobs_given = 0;
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if (ape__trace_arg(arg))
+			continue;
+		if (strncmp(arg, "--variant=", 10) == 0) {
+			/* A comma separated list, copied to split it */
+			char *names = ape_arena_strndup(&ape__arena, arg + 10,
+							strlen(arg + 10));
+			for (char *name = strtok(names, ","); name;
+			     name = strtok(NULL, ","))
+				ape_da_append(&ape__variant_names, name);
+			continue;
+		}
+		if (strcmp(arg, "--verbose") == 0 || strcmp(arg, "-v") == 0) {
+			ape__verbose = 1;
+			continue;
+		}
+		if (strcmp(arg, "--watch") == 0) {
+			ape__watch_mode = 1;
+			continue;
+		}
+		if (strncmp(arg, "--remote=", 9) == 0) {
+			ape__remote_addrs = arg + 9;
+			continue;
+		}
+		if (strcmp(arg, "--content-hash") == 0) {
+			ape__content_hash = 1;
+			continue;
+		}
+		if (strcmp(arg, "--cache") == 0 ||
+		    strncmp(arg, "--cache=", 8) == 0) {
+			ape__cache_dir = arg[7] == '=' ? arg + 8 : "";
+			continue;
+		}
+		if (strncmp(arg, "--cache-size=", 13) == 0) {
+			char *end = NULL;
+			unsigned long long mb = strtoull(arg + 13, &end, 10);
+			if (arg[13] == '\0' || *end != '\0' || mb == 0) {
+				fprintf(stderr,
+					"ERROR: Invalid cache size: %s\n",
+					arg + 13);
+				return 0;
+			}
+			ape__cache.max_size = mb << 20;
+			continue;
+		}
+		if (strcmp(arg, "--mem-budget") == 0) {
+			ape__mem_budget = -1;
+			continue;
+		}
+		if (strncmp(arg, "-m", 2) == 0 ||
+		    strncmp(arg, "--mem-budget=", 13) == 0) {
+			const char *value = arg + (arg[1] == 'm' ? 2 : 13);
+			if (arg[1] == 'm' && *value == '\0') {
+				if (i + 1 >= argc) {
+					fprintf(stderr,
+						"ERROR: -m expects a memory budget in MB\n");
+					return 0;
+				}
+				value = argv[++i];
+			}
+			char *end = NULL;
+			long long mb = strtoll(value, &end, 10);
+			if (*value == '\0' || *end != '\0' || mb < 0) {
+				fprintf(stderr,
+					"ERROR: Invalid memory budget: %s\n",
+					value);
+				return 0;
+			}
+			ape__mem_budget = (int64_t)mb << 20;
+			continue;
+		}
+		if (strncmp(arg, "-j", 2) != 0)
+			continue;
+		const char *value = arg + 2;
+		if (*value == '\0') {
+			if (i + 1 >= argc) {
+				fprintf(stderr,
+					"ERROR: -j expects a job count\n");
+				return 0;
+			}
+			value = argv[++i];
+		}
+		char *end = NULL;
+		long jobs = strtol(value, &end, 10);
+		if (*value == '\0' || *end != '\0' || jobs < 1) {
+			fprintf(stderr, "ERROR: Invalid job count: %s\n",
+				value);
+			return 0;
+		}
+		ape__jobs = (size_t)jobs;
+		ape__jobs_given = 1;
+	}
+	return 1;
+}
+
 int ape_run(int argc, char **argv)
 {
-	for (size_t i = 0; i < ape__builder_list.count; i++) {
-		fprintf(stderr, "INFO: Building %s...\n",
-			ape__builder_list.items[i].outfile);
-		int p = ape_run_builder(&ape__builder_list.items[i]);
-		if (!p)
-			return 1;
+	if (!ape__parse_args(argc, argv))
+		return 1;
+	ape__trace_import_rebuild();
+	/* Without -j the workers add their slots to ours */
+	if (ape__remote_addrs && *ape__remote_addrs) {
+		size_t slots = ape__remote_open(ape__remote_addrs);
+		if (!ape__jobs_given)
+			ape__jobs += slots;
 	}
-	return 0;
+	if (!ape_jobserver_open(ape__jobs))
+		ape__jobs = 1;
+	if (!ape_log_open(APE_LOG_FILE))
+		fprintf(stderr, "WARNING: Building without a build log\n");
+	if (ape__cache_dir) {
+		char *dir = *ape__cache_dir ? strdup(ape__cache_dir) :
+					      ape__default_cache_dir();
+		if (!dir || !ape_cache_open(dir))
+			fprintf(stderr,
+				"WARNING: Building without a compilation cache\n");
+		free(dir);
+	}
+	int ok = ape__build();
+	if (ape__watch_mode && !ape__interrupted)
+		ok = ape__watch_run(argv);
+	if (ape__cache.dir)
+		fprintf(stderr, "INFO: Cache: %zu hits, %zu misses\n",
+			ape__cache.hits, ape__cache.misses);
+	ape_log_close();
+	ape_jobserver_close();
+	if (ape__trace_path) {
+		ape__trace_summary(APE_TRACE_TOP);
+		ape_trace_write(ape__trace_path);
+	}
+	/* Die of the signal that stopped the build, like the commands did */
+	if (ape__interrupted) {
+		signal(ape__interrupted, SIG_DFL);
+		raise(ape__interrupted);
+	}
+	return ok ? 0 : 1;
 }
 
 #endif
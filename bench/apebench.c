@@ -0,0 +1,470 @@
+/* apebench: measures the overhead of apebuild itself on generated projects.
+ *
+ * A synthetic project of the given shape is written to a temporary
+ * directory, with a build script that includes the apebuild.h under test.
+ * Its build binary is then timed on a clean build, a no-op build and a build
+ * after touching a single source, and the results are written as JSON.
+ *
+ * Usage: apebench [options]
+ *   --files=N      Number of sources (200)
+ *   --depth=N      Directory depth of the sources of each target (2)
+ *   --headers=N    Number of headers (20)
+ *   --fan-in=N     Headers included by each source (5)
+ *   --builders=N   Number of targets (4)
+ *   --runs=N       Runs of the no-op and touch builds (5)
+ *   --clean-runs=N Runs of the clean build (1)
+ *   -j N           Jobs of the builds (the number of online CPUs)
+ *   --header=PATH  The apebuild.h to benchmark (apebuild.h)
+ *   --cc=CC        Compiler of the build script (gcc)
+ *   --dir=DIR      Directory of the project (a new one in /tmp)
+ *   --keep         Keep the project instead of removing it
+ *   --out=FILE     Write the results to FILE instead of stdout
+ *   -v             Show the output of the builds
+ */
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+	size_t files;
+	size_t depth;
+	size_t headers;
+	size_t fan_in;
+	size_t builders;
+	size_t runs;
+	size_t clean_runs;
+	long jobs;
+	const char *header;
+	const char *cc;
+	const char *dir;
+	int keep;
+	const char *out;
+	int verbose;
+} BenchOptions;
+
+typedef struct {
+	const char *name;
+	double *ms;
+	size_t count;
+	long peak_rss_kb;
+} BenchResult;
+
+BenchOptions bench_opts = {
+	.files = 200,
+	.depth = 2,
+	.headers = 20,
+	.fan_in = 5,
+	.builders = 4,
+	.runs = 5,
+	.clean_runs = 1,
+	.header = "apebuild.h",
+	.cc = "gcc",
+};
+
+/* The path of a file of the project */
+char bench_path[PATH_MAX];
+
+const char *bench_file(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+const char *bench_file(const char *fmt, ...)
+{
+	size_t n = strlen(bench_opts.dir);
+	memcpy(bench_path, bench_opts.dir, n);
+	bench_path[n++] = '/';
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(bench_path + n, sizeof(bench_path) - n, fmt, ap);
+	va_end(ap);
+	return bench_path;
+}
+
+/* Creates the directories leading to path */
+int bench_mkdirs(const char *path)
+{
+	char buf[PATH_MAX];
+	snprintf(buf, sizeof(buf), "%s", path);
+	for (char *p = buf + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(buf, 0755) != 0 && errno != EEXIST) {
+			fprintf(stderr, "ERROR: Could not create %s: %s\n", buf,
+				strerror(errno));
+			return 0;
+		}
+		*p = '/';
+	}
+	return 1;
+}
+
+FILE *bench_create(const char *path)
+{
+	if (!bench_mkdirs(path))
+		return NULL;
+	FILE *f = fopen(path, "w");
+	if (!f)
+		fprintf(stderr, "ERROR: Could not write %s: %s\n", path,
+			strerror(errno));
+	return f;
+}
+
+/* The directory of source i of its target, depth levels of up to four
+ * directories each */
+void bench_source_dir(size_t i, char *buf, size_t size)
+{
+	size_t n = snprintf(buf, size, "b%zu/", i % bench_opts.builders);
+	size_t k = i / bench_opts.builders;
+	for (size_t d = 0; d < bench_opts.depth && n < size; d++, k /= 4)
+		n += snprintf(buf + n, size - n, "d%zu/", k % 4);
+}
+
+int bench_generate(void)
+{
+	for (size_t h = 0; h < bench_opts.headers; h++) {
+		FILE *f = bench_create(bench_file("include/h%zu.h", h));
+		if (!f)
+			return 0;
+		fprintf(f,
+			"#ifndef H%zu_H\n#define H%zu_H\n"
+			"static inline int h%zu(int x)\n{\n"
+			"\treturn x * %zu + 1;\n}\n#endif\n",
+			h, h, h, h);
+		fclose(f);
+	}
+	char dir[PATH_MAX / 2];
+	for (size_t i = 0; i < bench_opts.files; i++) {
+		bench_source_dir(i, dir, sizeof(dir));
+		FILE *f = bench_create(bench_file("%sf%zu.c", dir, i));
+		if (!f)
+			return 0;
+		for (size_t k = 0; k < bench_opts.fan_in; k++)
+			fprintf(f, "#include \"h%zu.h\"\n",
+				(i * 7 + k) % bench_opts.headers);
+		fprintf(f, "int f%zu(int x)\n{\n\tint r = x;\n", i);
+		for (size_t k = 0; k < bench_opts.fan_in; k++)
+			fprintf(f, "\tr += h%zu(r);\n",
+				(i * 7 + k) % bench_opts.headers);
+		fprintf(f, "\treturn r;\n}\n");
+		/* The first source of every target is its main */
+		if (i < bench_opts.builders)
+			fprintf(f, "int main(void)\n{\n\treturn f%zu(0) & 0;\n}\n",
+				i);
+		fclose(f);
+	}
+
+	char header[PATH_MAX];
+	if (!realpath(bench_opts.header, header)) {
+		fprintf(stderr, "ERROR: Could not find %s: %s\n",
+			bench_opts.header, strerror(errno));
+		return 0;
+	}
+	FILE *f = bench_create(bench_file("build.c"));
+	if (!f)
+		return 0;
+	fprintf(f, "#define APEBUILD_IMPLEMENTATION\n"
+		   "#define APE_PRESET_LINUX_GCC_C\n"
+		   "#include \"%s\"\n"
+		   "#include <sys/resource.h>\n\n"
+		   "APEBUILD_MAIN(int argc, char **argv)\n{\n",
+		header);
+	for (size_t b = 0; b < bench_opts.builders; b++)
+		fprintf(f,
+			"\tAPE_BUILDER(\"t%zu\", {\n"
+			"\t\tAPE_INPUT_DIR_REC(\"b%zu/\");\n"
+			"\t\tAPE_INCLUDE_DIR(\"include/\");\n"
+			"\t});\n",
+			b, b);
+	/* The peak memory of the build binary alone, wait4() would count
+	 * that of the compilers too */
+	fprintf(f, "\tint status = ape_run(argc, argv);\n"
+		   "\tconst char *rss = getenv(\"APEBENCH_RSS\");\n"
+		   "\tFILE *f = rss ? fopen(rss, \"w\") : NULL;\n"
+		   "\tif (f) {\n"
+		   "\t\tstruct rusage ru;\n"
+		   "\t\tgetrusage(RUSAGE_SELF, &ru);\n"
+		   "\t\tfprintf(f, \"%%ld\\n\", ru.ru_maxrss);\n"
+		   "\t\tfclose(f);\n"
+		   "\t}\n"
+		   "\treturn status;\n}\n");
+	fclose(f);
+	return 1;
+}
+
+/* Runs argv in the project directory, returns its exit status or -1 */
+int bench_exec(char **argv, int quiet)
+{
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "ERROR: Could not fork: %s\n", strerror(errno));
+		return -1;
+	}
+	if (pid == 0) {
+		if (chdir(bench_opts.dir) != 0)
+			_exit(127);
+		if (quiet) {
+			int null = open("/dev/null", O_WRONLY);
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+		}
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	int wstatus;
+	if (waitpid(pid, &wstatus, 0) < 0)
+		return -1;
+	return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+}
+
+double bench_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Runs the build once and adds its time and peak memory to result */
+int bench_build(BenchResult *result)
+{
+	char jobs[32];
+	snprintf(jobs, sizeof(jobs), "-j%ld", bench_opts.jobs);
+	char *argv[] = { "./ape", jobs, NULL };
+	double start = bench_now_ms();
+	int status = bench_exec(argv, !bench_opts.verbose);
+	double ms = bench_now_ms() - start;
+	if (status != 0) {
+		fprintf(stderr, "ERROR: The %s build failed\n", result->name);
+		return 0;
+	}
+	result->ms[result->count++] = ms;
+	FILE *f = fopen(bench_file("rss"), "r");
+	long rss = 0;
+	if (f) {
+		if (fscanf(f, "%ld", &rss) != 1)
+			rss = 0;
+		fclose(f);
+	}
+	if (rss > result->peak_rss_kb)
+		result->peak_rss_kb = rss;
+	return 1;
+}
+
+int bench_rm(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	(void)st;
+	(void)type;
+	(void)ftw;
+	return remove(path);
+}
+
+int bench_rmtree(const char *path)
+{
+	if (access(path, F_OK) != 0)
+		return 1;
+	return nftw(path, bench_rm, 16, FTW_DEPTH | FTW_PHYS) == 0;
+}
+
+/* Bumps the mtime of a source past everything built so far */
+int bench_touch(size_t run)
+{
+	char dir[PATH_MAX / 2];
+	size_t i = bench_opts.files / 2;
+	bench_source_dir(i, dir, sizeof(dir));
+	struct timespec times[2];
+	clock_gettime(CLOCK_REALTIME, &times[0]);
+	times[0].tv_sec += 1 + run;
+	times[1] = times[0];
+	if (utimensat(AT_FDCWD, bench_file("%sf%zu.c", dir, i), times, 0) != 0) {
+		fprintf(stderr, "ERROR: Could not touch %s: %s\n", bench_path,
+			strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+int bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+void bench_write_result(FILE *f, BenchResult *r, int last)
+{
+	qsort(r->ms, r->count, sizeof(double), bench_cmp);
+	double sum = 0;
+	for (size_t i = 0; i < r->count; i++)
+		sum += r->ms[i];
+	double median = r->count % 2 ?
+				r->ms[r->count / 2] :
+				(r->ms[r->count / 2 - 1] + r->ms[r->count / 2]) /
+					2;
+	fprintf(f,
+		"    \"%s\": {\"runs\": %zu, \"min_ms\": %.3f, "
+		"\"median_ms\": %.3f, \"mean_ms\": %.3f, \"max_ms\": %.3f, "
+		"\"peak_rss_kb\": %ld}%s\n",
+		r->name, r->count, r->ms[0], median, sum / r->count,
+		r->ms[r->count - 1], r->peak_rss_kb, last ? "" : ",");
+}
+
+int bench_parse_size(const char *arg, const char *opt, size_t *out)
+{
+	size_t n = strlen(opt);
+	if (strncmp(arg, opt, n) != 0 || arg[n] != '=')
+		return 0;
+	char *end;
+	unsigned long long v = strtoull(arg + n + 1, &end, 10);
+	if (*end || end == arg + n + 1) {
+		fprintf(stderr, "ERROR: Invalid value for %s\n", opt);
+		exit(1);
+	}
+	*out = v;
+	return 1;
+}
+
+void bench_usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [--files=N] [--depth=N] [--headers=N] "
+		"[--fan-in=N] [--builders=N] [--runs=N] [--clean-runs=N] "
+		"[-j N] [--header=PATH] [--cc=CC] [--dir=DIR] [--keep] "
+		"[--out=FILE] [-v]\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	bench_opts.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	for (int i = 1; i < argc; i++) {
+		const char *a = argv[i];
+		if (bench_parse_size(a, "--files", &bench_opts.files) ||
+		    bench_parse_size(a, "--depth", &bench_opts.depth) ||
+		    bench_parse_size(a, "--headers", &bench_opts.headers) ||
+		    bench_parse_size(a, "--fan-in", &bench_opts.fan_in) ||
+		    bench_parse_size(a, "--builders", &bench_opts.builders) ||
+		    bench_parse_size(a, "--runs", &bench_opts.runs) ||
+		    bench_parse_size(a, "--clean-runs", &bench_opts.clean_runs))
+			continue;
+		if (strcmp(a, "-j") == 0 && i + 1 < argc)
+			bench_opts.jobs = atol(argv[++i]);
+		else if (strncmp(a, "-j", 2) == 0 && a[2])
+			bench_opts.jobs = atol(a + 2);
+		else if (strncmp(a, "--header=", 9) == 0)
+			bench_opts.header = a + 9;
+		else if (strncmp(a, "--cc=", 5) == 0)
+			bench_opts.cc = a + 5;
+		else if (strncmp(a, "--dir=", 6) == 0)
+			bench_opts.dir = a + 6;
+		else if (strcmp(a, "--keep") == 0)
+			bench_opts.keep = 1;
+		else if (strncmp(a, "--out=", 6) == 0)
+			bench_opts.out = a + 6;
+		else if (strcmp(a, "-v") == 0)
+			bench_opts.verbose = 1;
+		else {
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (bench_opts.builders == 0 || bench_opts.files < bench_opts.builders ||
+	    bench_opts.runs == 0 || bench_opts.clean_runs == 0 ||
+	    bench_opts.jobs < 1) {
+		fprintf(stderr, "ERROR: Need at least one source per target, "
+				"one run and one job\n");
+		return 1;
+	}
+	if (bench_opts.headers == 0)
+		bench_opts.fan_in = 0;
+	if (bench_opts.fan_in > bench_opts.headers)
+		bench_opts.fan_in = bench_opts.headers;
+
+	char tmp[] = "/tmp/apebench-XXXXXX";
+	if (bench_opts.dir) {
+		char buf[PATH_MAX];
+		snprintf(buf, sizeof(buf), "%s/", bench_opts.dir);
+		if (!bench_mkdirs(buf))
+			return 1;
+	} else if (!(bench_opts.dir = mkdtemp(tmp))) {
+		fprintf(stderr, "ERROR: Could not create a directory: %s\n",
+			strerror(errno));
+		return 1;
+	}
+	char dir[PATH_MAX];
+	if (!realpath(bench_opts.dir, dir)) {
+		fprintf(stderr, "ERROR: Could not find %s: %s\n",
+			bench_opts.dir, strerror(errno));
+		return 1;
+	}
+	bench_opts.dir = dir;
+	setenv("APEBENCH_RSS", bench_file("rss"), 1);
+
+	size_t runs = bench_opts.runs > bench_opts.clean_runs ?
+			      bench_opts.runs :
+			      bench_opts.clean_runs;
+	BenchResult clean = { .name = "clean" };
+	BenchResult noop = { .name = "noop" };
+	BenchResult touch = { .name = "touch" };
+	clean.ms = calloc(runs, sizeof(double));
+	noop.ms = calloc(runs, sizeof(double));
+	touch.ms = calloc(runs, sizeof(double));
+	int ok = bench_generate();
+	if (ok) {
+		/* The first build also rebuilds the build binary, so that
+		 * it knows its own dependencies, and isn't measured */
+		char *cc[] = { (char *)bench_opts.cc, "-o", "ape", "build.c",
+			       NULL };
+		double ms;
+		BenchResult warmup = { .name = "warmup", .ms = &ms };
+		ok = bench_exec(cc, 0) == 0 && bench_build(&warmup);
+		if (!ok)
+			fprintf(stderr, "ERROR: Could not build the project\n");
+	}
+	for (size_t i = 0; ok && i < bench_opts.clean_runs; i++)
+		ok = bench_rmtree(bench_file("build")) && bench_build(&clean);
+	for (size_t i = 0; ok && i < bench_opts.runs; i++)
+		ok = bench_build(&noop);
+	for (size_t i = 0; ok && i < bench_opts.runs; i++)
+		ok = bench_touch(i) && bench_build(&touch);
+
+	if (ok) {
+		FILE *f = bench_opts.out ? fopen(bench_opts.out, "w") : stdout;
+		if (!f) {
+			fprintf(stderr, "ERROR: Could not write %s: %s\n",
+				bench_opts.out, strerror(errno));
+			ok = 0;
+		} else {
+			fprintf(f,
+				"{\n  \"timestamp\": %lld,\n  \"jobs\": %ld,\n"
+				"  \"project\": {\"files\": %zu, \"depth\": %zu, "
+				"\"headers\": %zu, \"fan_in\": %zu, "
+				"\"builders\": %zu},\n  \"results\": {\n",
+				(long long)time(NULL), bench_opts.jobs,
+				bench_opts.files, bench_opts.depth,
+				bench_opts.headers, bench_opts.fan_in,
+				bench_opts.builders);
+			bench_write_result(f, &clean, 0);
+			bench_write_result(f, &noop, 0);
+			bench_write_result(f, &touch, 1);
+			fprintf(f, "  }\n}\n");
+			if (f != stdout)
+				fclose(f);
+		}
+	}
+	if (!bench_opts.keep && !bench_rmtree(bench_opts.dir))
+		fprintf(stderr, "WARNING: Could not remove %s\n", bench_opts.dir);
+	free(clean.ms);
+	free(noop.ms);
+	free(touch.ms);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+// Check of the compilation cache: a compile is stored and put back in place
+// on a hit, and a changed header or command line misses
+#define APEBUILD_IMPLEMENTATION
+#define APE_PRESET_LINUX_GCC_C
+#include "../apebuild.h"
+
+#define CHECK(cond)                                                       \
+	do {                                                              \
+		if (!(cond)) {                                            \
+			fprintf(stderr, "FAILED: %s:%d: %s\n", __FILE__, \
+				__LINE__, #cond);                         \
+			return 1;                                         \
+		}                                                         \
+	} while (0)
+
+/* Writes content to path, dated a while back so that the cache doesn't
+ * think it changed during the compile */
+int write_file(const char *path, const char *content)
+{
+	FILE *f = fopen(path, "w");
+	if (!f)
+		return 0;
+	fputs(content, f);
+	fclose(f);
+	struct timespec times[2] = { { time(NULL) - 10, 0 },
+				     { time(NULL) - 10, 0 } };
+	ape_stat_cache_invalidate(path);
+	return utimensat(AT_FDCWD, path, times, 0) == 0;
+}
+
+/* Removes the object and returns the job to make it, running it if the
+ * cache didn't have it */
+ApeJob compile(char *src, ApeStrList args)
+{
+	unlink(ape_objfile_name(src));
+	ape_stat_cache_invalidate(ape_objfile_name(src));
+	ApeJob job = ape_gen_build_job(src, 0, args);
+	if (job.cmd.count > 0) {
+		job.started = ape__now_ns();
+		if (ape_cmd_run_sync(job.cmd))
+			ape_job_finish(&job);
+	}
+	return job;
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/apebuild-check-XXXXXX";
+	CHECK(mkdtemp(dir) && chdir(dir) == 0);
+	CHECK(mkdir("src", 0755) == 0);
+	CHECK(write_file("src/main.c", "#include \"main.h\"\n"
+				       "int main(void)\n{\n\treturn N;\n}\n"));
+	CHECK(write_file("src/main.h", "#define N 0\n"));
+	CHECK(ape_cache_open("cache"));
+	char *src = ape_intern("src/main.c");
+	char *obj = ape_objfile_name(src);
+	ApeStrList args = { 0 };
+
+	/* Miss, the compile is stored */
+	ApeJob job = compile(src, args);
+	CHECK(job.cmd.count > 0 && job.cache_key);
+	CHECK(ape__cache.hits == 0 && ape__cache.misses == 1);
+	ape_job_free(job);
+
+	/* Hit, the object is back without a compile */
+	job = compile(src, args);
+	CHECK(job.cmd.count == 0);
+	CHECK(ape__cache.hits == 1);
+	CHECK(ape_stat_cached(obj));
+
+	/* The header changed, so the manifest entry doesn't match anymore */
+	struct stat st;
+	uint64_t zero, one, hash;
+	CHECK(stat(obj, &st) == 0 && ape__hash_file(obj, st.st_size, &zero));
+	CHECK(write_file("src/main.h", "#define N 1\n"));
+	job = compile(src, args);
+	CHECK(job.cmd.count > 0);
+	CHECK(ape__cache.hits == 1 && ape__cache.misses == 2);
+	ape_job_free(job);
+	CHECK(stat(obj, &st) == 0 && ape__hash_file(obj, st.st_size, &one));
+	CHECK(one != zero);
+
+	/* Both versions of the header are in the manifest now, and each
+	 * gets its own object back */
+	CHECK(write_file("src/main.h", "#define N 0\n"));
+	job = compile(src, args);
+	CHECK(job.cmd.count == 0 && ape__cache.hits == 2);
+	CHECK(stat(obj, &st) == 0 && ape__hash_file(obj, st.st_size, &hash));
+	CHECK(hash == zero);
+	CHECK(write_file("src/main.h", "#define N 1\n"));
+	job = compile(src, args);
+	CHECK(job.cmd.count == 0 && ape__cache.hits == 3);
+	CHECK(stat(obj, &st) == 0 && ape__hash_file(obj, st.st_size, &hash));
+	CHECK(hash == one);
+
+	/* Another command line is another key */
+	ape_da_append(&args, "-DUNUSED");
+	job = compile(src, args);
+	CHECK(job.cmd.count > 0);
+	CHECK(ape__cache.hits == 3 && ape__cache.misses == 3);
+	ape_job_free(job);
+	ape_da_free(args);
+
+	CHECK(system("rm -rf -- \"$PWD\"") == 0);
+	fprintf(stderr, "OK: compilation cache\n");
+	return 0;
+}
@@ -0,0 +1,71 @@
+// Check of ape_parse_depfile on the corner cases of make style depfiles:
+// several targets, escaped spaces and line continuations
+#define APEBUILD_IMPLEMENTATION
+#define APE_PRESET_LINUX_GCC_C
+#include "../apebuild.h"
+
+#define CHECK(cond)                                                       \
+	do {                                                              \
+		if (!(cond)) {                                            \
+			fprintf(stderr, "FAILED: %s:%d: %s\n", __FILE__, \
+				__LINE__, #cond);                         \
+			return 1;                                         \
+		}                                                         \
+	} while (0)
+
+/* Writes content to path and parses it back into deps */
+int parse(const char *path, const char *content, ApeStrList *deps)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f)
+		return 0;
+	fputs(content, f);
+	fclose(f);
+	deps->count = 0;
+	return ape_parse_depfile(path, deps);
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/apebuild-check-XXXXXX";
+	CHECK(mkdtemp(dir) && chdir(dir) == 0);
+	ApeStrList deps = { 0 };
+
+	CHECK(!ape_parse_depfile("missing.d", &deps));
+
+	/* Several targets, and the phony rules of -MP after the first one */
+	CHECK(parse("a.d", "a.o a.s: src/a.c include/a.h\n\ninclude/a.h:\n",
+		    &deps));
+	CHECK(deps.count == 2);
+	CHECK(strcmp(deps.items[0], "src/a.c") == 0);
+	CHECK(strcmp(deps.items[1], "include/a.h") == 0);
+
+	/* Escaped spaces and hashes, and $$ for a dollar sign */
+	CHECK(parse("b.d", "b.o: my\\ dir/b.c x\\#1.h cost$$.h\n", &deps));
+	CHECK(deps.count == 3);
+	CHECK(strcmp(deps.items[0], "my dir/b.c") == 0);
+	CHECK(strcmp(deps.items[1], "x#1.h") == 0);
+	CHECK(strcmp(deps.items[2], "cost$.h") == 0);
+
+	/* Continuations, also with CRLF line endings and a target path that
+	 * has a colon in it */
+	CHECK(parse("c.d",
+		    "build/c:1.o: \\\n src/c.c \\\r\n\tinclude/c.h\\\n"
+		    " \\\n  include/d.h\r\n",
+		    &deps));
+	CHECK(deps.count == 3);
+	CHECK(strcmp(deps.items[0], "src/c.c") == 0);
+	CHECK(strcmp(deps.items[1], "include/c.h") == 0);
+	CHECK(strcmp(deps.items[2], "include/d.h") == 0);
+
+	/* No trailing newline, and no prerequisites at all */
+	CHECK(parse("d.d", "d.o: d.c", &deps));
+	CHECK(deps.count == 1 && strcmp(deps.items[0], "d.c") == 0);
+	CHECK(parse("e.d", "e.o:\n", &deps));
+	CHECK(deps.count == 0);
+
+	ape_da_free(deps);
+	CHECK(system("rm -rf -- \"$PWD\"") == 0);
+	fprintf(stderr, "OK: ape_parse_depfile\n");
+	return 0;
+}
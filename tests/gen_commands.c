@@ -0,0 +1,52 @@
+// Check of ape_builder_gen_commands: generates the commands of a small
+// project in a temporary directory, with nothing built and then with
+// everything up to date
+#define APEBUILD_IMPLEMENTATION
+#define APE_PRESET_LINUX_GCC_C
+#include "../apebuild.h"
+
+#define CHECK(cond)                                                       \
+	do {                                                              \
+		if (!(cond)) {                                            \
+			fprintf(stderr, "FAILED: %s:%d: %s\n", __FILE__, \
+				__LINE__, #cond);                         \
+			return 1;                                         \
+		}                                                         \
+	} while (0)
+
+int main(void)
+{
+	char dir[] = "/tmp/apebuild-check-XXXXXX";
+	CHECK(mkdtemp(dir) && chdir(dir) == 0);
+	CHECK(mkdir("src", 0755) == 0);
+	FILE *f = fopen("src/main.c", "w");
+	CHECK(f);
+	fputs("int main(void)\n{\n\treturn 0;\n}\n", f);
+	fclose(f);
+	f = fopen("src/util.c", "w");
+	CHECK(f);
+	fputs("int util(void)\n{\n\treturn 1;\n}\n", f);
+	fclose(f);
+
+	ApeBuilder builder = { .outfile = "check" };
+	/* Returns whether the scan failed */
+	CHECK(!ape_builder_append_dir(&builder, "src/"));
+	ApeCmdList cmds = ape_builder_gen_commands(&builder);
+	/* Two compiles and the link */
+	CHECK(cmds.count == 3);
+	for (size_t i = 0; i < cmds.count; i++)
+		CHECK(ape_cmd_run_sync(cmds.items[i]));
+	for (size_t i = 0; i < cmds.count; i++)
+		ape_cmd_free(cmds.items[i]);
+	ape_da_free(cmds);
+
+	/* Without a build log, the outputs of the commands tell that nothing
+	 * is left to do */
+	cmds = ape_builder_gen_commands(&builder);
+	CHECK(cmds.count == 0);
+	ape_da_free(cmds);
+
+	CHECK(system("rm -rf -- \"$PWD\"") == 0);
+	fprintf(stderr, "OK: ape_builder_gen_commands\n");
+	return 0;
+}
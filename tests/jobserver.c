@@ -0,0 +1,37 @@
+// Check of the jobserver: a build that created one leaves MAKEFLAGS as it
+// found it, so that a build restarted by --watch can create its own
+#define APEBUILD_IMPLEMENTATION
+#define APE_PRESET_LINUX_GCC_C
+#include "../apebuild.h"
+
+#define CHECK(cond)                                                       \
+	do {                                                              \
+		if (!(cond)) {                                            \
+			fprintf(stderr, "FAILED: %s:%d: %s\n", __FILE__, \
+				__LINE__, #cond);                         \
+			return 1;                                         \
+		}                                                         \
+	} while (0)
+
+int main(void)
+{
+	unsetenv("MAKEFLAGS");
+	CHECK(ape_jobserver_open(4) && ape__jobserver.rfd >= 0);
+	CHECK(getenv("MAKEFLAGS"));
+	char token;
+	CHECK(read(ape__jobserver.rfd, &token, 1) == 1);
+	CHECK(write(ape__jobserver.wfd, &token, 1) == 1);
+	ape_jobserver_close();
+	CHECK(!getenv("MAKEFLAGS"));
+
+	/* Like the exec of a restart, which keeps the environment */
+	setenv("MAKEFLAGS", "-k", 1);
+	for (int i = 0; i < 2; i++) {
+		CHECK(ape_jobserver_open(4) && ape__jobserver.rfd >= 0);
+		CHECK(strstr(getenv("MAKEFLAGS"), "--jobserver-auth=fifo:"));
+		ape_jobserver_close();
+		CHECK(strcmp(getenv("MAKEFLAGS"), "-k") == 0);
+	}
+	fprintf(stderr, "OK: jobserver\n");
+	return 0;
+}
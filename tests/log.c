@@ -0,0 +1,99 @@
+// Check of the build log: entries survive closing and reopening it, a
+// changed command or input is noticed, and a log made up mostly of dead
+// entries is compacted without losing the live ones
+#define APEBUILD_IMPLEMENTATION
+#define APE_PRESET_LINUX_GCC_C
+#include "../apebuild.h"
+
+#define CHECK(cond)                                                       \
+	do {                                                              \
+		if (!(cond)) {                                            \
+			fprintf(stderr, "FAILED: %s:%d: %s\n", __FILE__, \
+				__LINE__, #cond);                         \
+			return 1;                                         \
+		}                                                         \
+	} while (0)
+
+/* Writes content to path with the given mtime in seconds */
+int write_file(const char *path, const char *content, time_t mtime)
+{
+	FILE *f = fopen(path, "w");
+	if (!f)
+		return 0;
+	fputs(content, f);
+	fclose(f);
+	struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+	ape_stat_cache_invalidate(path);
+	return utimensat(AT_FDCWD, path, times, 0) == 0;
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/apebuild-check-XXXXXX";
+	CHECK(mkdtemp(dir) && chdir(dir) == 0);
+	char *inputs[] = { ape_intern("in.c"), ape_intern("in.h") };
+	char *out = ape_intern("out.o");
+	CHECK(write_file(inputs[0], "c", 1000));
+	CHECK(write_file(inputs[1], "h", 1000));
+	CHECK(write_file(out, "o", 2000));
+
+	CHECK(ape_log_needs_rebuild(out, 1) == -1);
+	CHECK(ape_log_open("log/build.log"));
+	CHECK(ape_log_needs_rebuild(out, 1) == 1);
+	CHECK(ape_log_record(out, 1, inputs, 2, 42, 4096));
+	CHECK(ape_log_needs_rebuild(out, 1) == 0);
+	CHECK(ape_log_needs_rebuild(out, 2) == 1);
+
+	/* Everything comes back from the file */
+	ape_log_close();
+	CHECK(ape_log_open("log/build.log"));
+	CHECK(ape_log_needs_rebuild(out, 1) == 0);
+	CHECK(ape_log_duration(out) == 42);
+	CHECK(ape_log_max_rss(out) == 4096);
+	CHECK(ape_log_hash(out) == ape_hash64("o", 1, 0));
+
+	/* A touched input needs a rebuild, a touched output that is still
+	 * the same doesn't */
+	CHECK(write_file(inputs[1], "h", 1500));
+	CHECK(ape_log_needs_rebuild(out, 1) == 1);
+	CHECK(ape_log_record(out, 1, inputs, 2, 0, 0));
+	CHECK(ape_log_duration(out) == 42);
+	CHECK(write_file(out, "o", 3000));
+	CHECK(ape_log_needs_rebuild(out, 1) == 0);
+	CHECK(write_file(out, "p", 3500));
+	CHECK(ape_log_needs_rebuild(out, 1) == 1);
+
+	/* Replace the entry until compaction kicks in on the next open */
+	for (int i = 0; i <= APE__LOG_COMPACT_MIN; i++)
+		CHECK(ape_log_record(out, 3, inputs, 2, i + 1, 0));
+	ape_log_close();
+	struct stat before, after;
+	CHECK(stat("log/build.log", &before) == 0);
+	CHECK(ape_log_open("log/build.log"));
+	CHECK(stat("log/build.log", &after) == 0);
+	CHECK(after.st_size < before.st_size / 100);
+	CHECK(ape_log_needs_rebuild(out, 3) == 0);
+	CHECK(ape_log_duration(out) == APE__LOG_COMPACT_MIN + 1);
+
+	/* And the compacted log reads back the same */
+	ape_log_close();
+	CHECK(ape_log_open("log/build.log"));
+	CHECK(ape_log_needs_rebuild(out, 3) == 0);
+	CHECK(ape_log_needs_rebuild(out, 1) == 1);
+	CHECK(ape_log_record(out, 1, inputs, 2, 0, 0));
+	CHECK(ape_log_needs_rebuild(out, 1) == 0);
+	ape_log_close();
+
+	/* A corrupted tail is dropped, the entries before it are kept */
+	FILE *f = fopen("log/build.log", "a");
+	CHECK(f);
+	fputs("garbage", f);
+	fclose(f);
+	CHECK(ape_log_open("log/build.log"));
+	CHECK(ape_log_needs_rebuild(out, 1) == 0);
+	ape_log_close();
+
+	CHECK(system("rm -rf -- \"$PWD\"") == 0);
+	fprintf(stderr, "OK: build log\n");
+	return 0;
+}
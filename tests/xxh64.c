@@ -0,0 +1,48 @@
+// Check of ape_hash64 against known XXH64 values, on inputs that go through
+// the 32 byte stripes and every kind of tail, with and without a seed
+#define APEBUILD_IMPLEMENTATION
+#define APE_PRESET_LINUX_GCC_C
+#include "../apebuild.h"
+
+#define CHECK(cond)                                                       \
+	do {                                                              \
+		if (!(cond)) {                                            \
+			fprintf(stderr, "FAILED: %s:%d: %s\n", __FILE__, \
+				__LINE__, #cond);                         \
+			return 1;                                         \
+		}                                                         \
+	} while (0)
+
+#define PRIME32 2654435761ULL
+
+int main(void)
+{
+	CHECK(ape_hash64("", 0, 0) == 0xef46db3751d8e999ULL);
+	CHECK(ape_hash64(NULL, 0, 0) == 0xef46db3751d8e999ULL);
+	CHECK(ape_hash64("a", 1, 0) == 0xd24ec4f1a98c6e5bULL);
+	CHECK(ape_hash64("abc", 3, 0) == 0x44bc2cf5ad770999ULL);
+	const char *s = "Nobody inspects the spammish repetition";
+	CHECK(ape_hash64(s, strlen(s), 0) == 0xfbcea83c8a378bf1ULL);
+
+	/* The sanity buffer of the xxHash test suite */
+	unsigned char buf[256];
+	uint64_t gen = PRIME32;
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		buf[i] = gen >> 56;
+		gen *= 11400714785074694791ULL;
+	}
+	CHECK(ape_hash64(buf, 1, 0) == 0xe934a84adb052768ULL);
+	CHECK(ape_hash64(buf, 1, PRIME32) == 0x5014607643a9b4c3ULL);
+	CHECK(ape_hash64(buf, 14, 0) == 0xb89b3598e0bd0a0aULL);
+	CHECK(ape_hash64(buf, 14, PRIME32) == 0x9bb5720d90b3d7f1ULL);
+	CHECK(ape_hash64(buf, 222, 0) == 0x06cc5bd930bcec3aULL);
+	CHECK(ape_hash64(buf, 222, PRIME32) == 0x0b105469df89af66ULL);
+
+	/* The input doesn't have to be aligned */
+	unsigned char copy[sizeof(buf) + 1];
+	memcpy(copy + 1, buf, 222);
+	CHECK(ape_hash64(copy + 1, 222, 0) == 0x06cc5bd930bcec3aULL);
+
+	fprintf(stderr, "OK: ape_hash64\n");
+	return 0;
+}
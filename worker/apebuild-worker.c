@@ -0,0 +1,9 @@
+// apebuild-worker: runs the remote compiles of builds started with --remote
+#define APEBUILD_IMPLEMENTATION
+#define APE_PRESET_LINUX_GCC_C
+#include "../apebuild.h"
+
+int main(int argc, char **argv)
+{
+	return ape_worker_run(argc, argv);
+}